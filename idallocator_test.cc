@@ -0,0 +1,192 @@
+/*
+ * idallocator_test.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+
+/**
+ *
+ * 	ZKIdAllocator号段切换逻辑的测试，不需要连接zk：派生类从本地计数器租用号段，
+ * 	覆盖多次切换号段后ID连续、多线程下ID唯一且每个线程内递增，以及租用失败时Next超时、恢复后继续分配。
+ *
+ */
+
+#include <stdio.h>
+#include <pthread.h>
+#include <algorithm>
+#include <vector>
+#include "zkidallocator.h"
+
+namespace {
+	int failures = 0;
+
+	void Check(bool ok, const char* what) {
+		printf("%s %s\n", ok ? "PASS" : "FAIL", what);
+		if (!ok) {
+			++failures;
+		}
+	}
+
+	// 从本地计数器租用号段，可以模拟租用失败
+	class LocalAllocator : public ZKIdAllocator {
+	public:
+		LocalAllocator(int block_size, int64_t next)
+			: ZKIdAllocator("/local", block_size), block_size_(block_size), next_(next), leases_(0), failing_(false) {
+			pthread_mutex_init(&mutex_, NULL);
+		}
+
+		~LocalAllocator() {
+			Stop();
+			pthread_mutex_destroy(&mutex_);
+		}
+
+		void SetFailing(bool failing) {
+			pthread_mutex_lock(&mutex_);
+			failing_ = failing;
+			pthread_mutex_unlock(&mutex_);
+		}
+
+		int leases() {
+			pthread_mutex_lock(&mutex_);
+			int leases = leases_;
+			pthread_mutex_unlock(&mutex_);
+			return leases;
+		}
+
+	protected:
+		virtual bool CreateCounter() {
+			return true;
+		}
+
+		virtual bool Lease(int64_t* start) {
+			pthread_mutex_lock(&mutex_);
+			bool ok = !failing_;
+			if (ok) {
+				*start = next_;
+				next_ += block_size_;
+				++leases_;
+			}
+			pthread_mutex_unlock(&mutex_);
+			return ok;
+		}
+
+	private:
+		int block_size_;
+		int64_t next_;
+		int leases_;
+		bool failing_;
+		pthread_mutex_t mutex_;
+	};
+
+	struct Worker {
+		LocalAllocator* allocator;
+		int count;
+		std::vector<int64_t> ids;
+		bool ok;
+	};
+
+	void* WorkerMain(void* arg) {
+		Worker* worker = (Worker*)arg;
+		worker->ok = true;
+		for (int i = 0; i < worker->count; ++i) {
+			int64_t id;
+			if (!worker->allocator->Next(&id, 5000)) {
+				worker->ok = false;
+				break;
+			}
+			worker->ids.push_back(id);
+		}
+		return NULL;
+	}
+}
+
+int main(int argc, char** argv) {
+	// 单线程：号段很小，切换很多次后ID仍从起点连续
+	{
+		LocalAllocator allocator(4, 100);
+		Check(allocator.Init(), "init");
+		Check(!allocator.Init(), "init twice fails");
+		bool sequential = true;
+		for (int i = 0; i < 4000 && sequential; ++i) {
+			int64_t id;
+			sequential = allocator.Next(&id) && id == 100 + i;
+		}
+		Check(sequential, "sequential across generations");
+		// 1000个号段，预取最多多租一个
+		Check(allocator.leases() == 1000 || allocator.leases() == 1001, "one lease per block");
+	}
+
+	// 号段大小为1：每个ID都要切换号段
+	{
+		LocalAllocator allocator(1, 0);
+		bool sequential = allocator.Init();
+		for (int i = 0; i < 1000 && sequential; ++i) {
+			int64_t id;
+			sequential = allocator.Next(&id) && id == i;
+		}
+		Check(sequential, "block size of one");
+	}
+
+	// 多线程：ID唯一、每个线程内递增、没有超出已租用的范围
+	{
+		const int kThreads = 8;
+		const int kCount = 20000;
+		const int kBlockSize = 16;
+		LocalAllocator allocator(kBlockSize, 0);
+		Check(allocator.Init(), "init for threads");
+		Worker workers[kThreads];
+		pthread_t tids[kThreads];
+		for (int i = 0; i < kThreads; ++i) {
+			workers[i].allocator = &allocator;
+			workers[i].count = kCount;
+			pthread_create(&tids[i], NULL, WorkerMain, &workers[i]);
+		}
+		bool ok = true, increasing = true;
+		std::vector<int64_t> all;
+		for (int i = 0; i < kThreads; ++i) {
+			pthread_join(tids[i], NULL);
+			ok = ok && workers[i].ok;
+			for (size_t j = 1; j < workers[i].ids.size(); ++j) {
+				increasing = increasing && workers[i].ids[j - 1] < workers[i].ids[j];
+			}
+			all.insert(all.end(), workers[i].ids.begin(), workers[i].ids.end());
+		}
+		std::sort(all.begin(), all.end());
+		Check(ok && all.size() == (size_t)kThreads * kCount, "all threads allocated");
+		Check(std::adjacent_find(all.begin(), all.end()) == all.end(), "ids are unique");
+		Check(increasing, "ids increase within a thread");
+		Check(!all.empty() && all.front() >= 0 && all.back() < (int64_t)allocator.leases() * kBlockSize,
+				"ids come from leased blocks");
+	}
+
+	// 租用失败：用完已取到的号段后Next超时，恢复后继续分配更大的ID
+	{
+		LocalAllocator allocator(4, 0);
+		Check(allocator.Init(), "init before failure");
+		int64_t id = -1, last = -1;
+		for (int i = 0; i < 8; ++i) {
+			allocator.Next(&last);
+		}
+		allocator.SetFailing(true);
+		int allocated = 0;
+		while (allocated < 100 && allocator.Next(&id, 50)) {
+			last = id;
+			++allocated;
+		}
+		Check(allocated <= 4, "next times out when leasing fails");
+		allocator.SetFailing(false);
+		Check(allocator.Next(&id, 1000) && id > last, "recovers after leasing succeeds");
+	}
+
+	// 第一次租用失败时Init失败
+	{
+		LocalAllocator allocator(4, 0);
+		allocator.SetFailing(true);
+		Check(!allocator.Init(), "init fails when leasing fails");
+	}
+
+	printf("%s\n", failures ? "FAILED" : "ALL PASSED");
+	return failures ? -1 : 0;
+}
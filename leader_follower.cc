@@ -14,18 +14,19 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <assert.h>
 #include <unistd.h>
 #include <sys/time.h>
 #include <sys/types.h>
-#include <vector>
-#include <algorithm>
 #include "zkclient.h"
+#include "zksequence.h"
 
 namespace {
 	bool leader = false;
 	char node_id[1024];
+	ZKSequenceIndex nodes; // 在线节点按序号排序，只在zk回调线程里访问
 }
 
 void NodeGetNodeHandler(ZKErrorCode errcode, const std::string& path, const char* value, int value_len, void* context) {
@@ -48,11 +49,14 @@ void NodeGetChildrenHandler(ZKErrorCode errcode, const std::string& path, int co
 		if (!leader) { // 在follower状态才需要关注leader变化，在leader状态无需关注
 			assert(count); // 无人为干预, 至少应该有自己在线
 
-			std::vector<std::string> nodes(data, data + count);
-			std::sort(nodes.begin(), nodes.end());
+			// 增量更新索引，序号最小的节点是leader
+			nodes.Update(count, data);
+			if (nodes.Min() < 0) { // 没有带序号的子节点（例如被人为创建了其他节点），等待下一次变化
+				return;
+			}
 
 			std::string leader_node("/leader_follower/");
-			leader_node.append(nodes[0]);
+			leader_node.append(nodes.NameAt(nodes.Min()));
 
 			// 获取leader节点的value，与node_id比较确认是否自己成为leader。
 			ZKClient::GetInstance().GetNode(leader_node, NodeGetNodeHandler, NULL); // no watch
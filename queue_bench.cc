@@ -0,0 +1,121 @@
+/*
+ * queue_bench.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+
+/**
+ *
+ * 	ZKQueue吞吐测试：生产者按批入队，多个消费者线程按批出队，分别统计入队和出队的吞吐。
+ *
+ * 	用法：queue_bench [元素总数] [入队批大小] [出队批大小] [消费者线程数] [元素字节数]
+ * 	批大小都取1即为逐个入队/出队，可以作为对比。
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <algorithm>
+#include "zkclient.h"
+#include "zkqueue.h"
+
+namespace {
+	const char* kQueuePath = "/queue_bench";
+
+	int total_items = 10000;
+	int push_batch = 100;
+	int pop_batch = 100;
+	int consumers = 4;
+	int item_bytes = 64;
+
+	pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	int popped = 0;
+	int pop_rounds = 0;
+
+	int64_t GetCurrentUs() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+}
+
+void* ConsumerMain(void* arg) {
+	ZKQueue queue(kQueuePath); // 每个消费者线程各用一个对象
+	for (;;) {
+		pthread_mutex_lock(&mutex);
+		bool done = popped >= total_items;
+		pthread_mutex_unlock(&mutex);
+		if (done) {
+			break;
+		}
+		std::vector<std::string> items;
+		ZKErrorCode errcode = queue.Pop(&items, pop_batch, 1000);
+		if (errcode == kZKError) {
+			fprintf(stderr, "Pop failed\n");
+			break;
+		}
+		pthread_mutex_lock(&mutex);
+		popped += items.size();
+		pop_rounds += items.empty() ? 0 : 1;
+		pthread_mutex_unlock(&mutex);
+	}
+	return NULL;
+}
+
+int main(int argc, char** argv) {
+	int* params[] = { &total_items, &push_batch, &pop_batch, &consumers, &item_bytes };
+	for (int i = 1; i < argc && i <= (int)(sizeof(params) / sizeof(params[0])); ++i) {
+		*params[i - 1] = atoi(argv[i]);
+	}
+	if (total_items <= 0 || push_batch <= 0 || pop_batch <= 0 || consumers <= 0 || item_bytes < 0) {
+		fprintf(stderr, "usage: %s [items] [push_batch] [pop_batch] [consumers] [item_bytes]\n", argv[0]);
+		return -1;
+	}
+
+	ZKClient& zkclient = ZKClient::GetInstance();
+	if (!zkclient.Init("127.0.0.1:3000,127.0.0.1:3001,127.0.0.1:3002", 10000)) {
+		fprintf(stderr, "ZKClient failed to init...\n");
+		return -1;
+	}
+	ZKQueue queue(kQueuePath);
+	if (!queue.Init()) {
+		fprintf(stderr, "ZKQueue failed to init...\n");
+		return -1;
+	}
+
+	// 入队
+	std::string item(item_bytes, 'x');
+	int64_t start_us = GetCurrentUs();
+	for (int pushed = 0; pushed < total_items; ) {
+		int count = std::min(push_batch, total_items - pushed);
+		std::vector<std::string> items(count, item);
+		ZKErrorCode errcode = push_batch == 1 ? queue.Push(item) : queue.Push(items);
+		if (errcode != kZKSucceed) {
+			fprintf(stderr, "Push failed, errcode=%d\n", errcode);
+			return -1;
+		}
+		pushed += count;
+	}
+	int64_t push_us = GetCurrentUs() - start_us;
+	printf("Push %d items, batch=%d: %.3fs, %.0f items/s\n", total_items, push_batch, push_us / 1e6,
+			total_items * 1e6 / (push_us ? push_us : 1));
+
+	// 出队
+	start_us = GetCurrentUs();
+	std::vector<pthread_t> tids(consumers);
+	for (int i = 0; i < consumers; ++i) {
+		pthread_create(&tids[i], NULL, ConsumerMain, NULL);
+	}
+	for (int i = 0; i < consumers; ++i) {
+		pthread_join(tids[i], NULL);
+	}
+	int64_t pop_us = GetCurrentUs() - start_us;
+	printf("Pop %d items, batch=%d, consumers=%d: %.3fs, %.0f items/s, %.1f items/round\n", popped, pop_batch,
+			consumers, pop_us / 1e6, popped * 1e6 / (pop_us ? pop_us : 1), pop_rounds ? (double)popped / pop_rounds : 0);
+	return 0;
+}
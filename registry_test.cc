@@ -0,0 +1,144 @@
+/*
+ * registry_test.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+
+/**
+ *
+ * 	ZKServiceRegistry选择逻辑的测试，不需要连接zk：用Update直接发布实例列表，
+ * 	覆盖子节点名的编码解析、Pick/PickTwo的权重分布（包括权重为0的实例）以及没有可用实例的情况。
+ *
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "zkregistry.h"
+
+namespace {
+	int failures = 0;
+
+	void Check(bool ok, const char* what) {
+		printf("%s %s\n", ok ? "PASS" : "FAIL", what);
+		if (!ok) {
+			++failures;
+		}
+	}
+
+	std::string Name(const std::string& address, int weight, const std::string& zone = "") {
+		std::string name;
+		ZKServiceRegistry::EncodeName(address, weight, zone, &name);
+		return name;
+	}
+
+	// 观测频率与期望概率的偏差在5个标准差以内
+	bool Near(int hits, int samples, double expected) {
+		double deviation = sqrt(samples * expected * (1 - expected));
+		return fabs(hits - samples * expected) <= 5 * deviation + 1;
+	}
+}
+
+int main(int argc, char** argv) {
+	// 编码和解析
+	ZKEndpoint endpoint;
+	std::string name;
+	Check(ZKServiceRegistry::EncodeName("10.0.0.1:80", 5, "bj", &name) && name == "10.0.0.1:80#5#bj" &&
+			ZKServiceRegistry::ParseName(name.c_str(), &endpoint) && strcmp(endpoint.address, "10.0.0.1:80") == 0 &&
+			endpoint.weight == 5 && strcmp(endpoint.zone, "bj") == 0, "encode and parse");
+	Check(!ZKServiceRegistry::EncodeName("a/b:1", 1, "", &name) && !ZKServiceRegistry::EncodeName("h:1", -1, "", &name) &&
+			!ZKServiceRegistry::EncodeName("h:1", 1, "z#1", &name), "invalid fields rejected");
+	Check(!ZKServiceRegistry::ParseName("h:1#x#", &endpoint) && !ZKServiceRegistry::ParseName("h:1#1", &endpoint) &&
+			!ZKServiceRegistry::ParseName("#1#z", &endpoint) && !ZKServiceRegistry::ParseName("h:1#1#z#", &endpoint),
+			"malformed names rejected");
+
+	// 没有实例
+	ZKServiceRegistry registry("/service");
+	ZKEndpoint first, second;
+	std::vector<ZKEndpoint> endpoints;
+	Check(!registry.Pick(&first) && !registry.PickTwo(&first, &second) && registry.GetEndpoints(&endpoints) == 0,
+			"no snapshot");
+
+	// 全部权重为0，不是服务实例的子节点被忽略
+	std::vector<std::string> children;
+	children.push_back(Name("a:1", 0));
+	children.push_back(Name("b:1", 0));
+	children.push_back("lock");
+	registry.Update(children);
+	Check(!registry.Pick(&first) && !registry.PickTwo(&first, &second) && registry.GetEndpoints(&endpoints) == 2,
+			"all zero weights");
+
+	// 只有一个可用实例时两个相同
+	children.push_back(Name("c:1", 2));
+	registry.Update(children);
+	bool same = true;
+	for (int i = 0; i < 1000 && same; ++i) {
+		same = registry.PickTwo(&first, &second) && strcmp(first.address, "c:1") == 0 && strcmp(second.address, "c:1") == 0;
+	}
+	Check(same, "single available endpoint");
+
+	// 权重分布：a=1 b=3 c=0 d=6
+	children.clear();
+	children.push_back(Name("d:1", 6, "sh"));
+	children.push_back(Name("a:1", 1));
+	children.push_back(Name("c:1", 0));
+	children.push_back(Name("b:1", 3, "bj"));
+	registry.Update(children);
+	Check(registry.GetEndpoints(&endpoints) == 4 && strcmp(endpoints[0].address, "a:1") == 0 &&
+			strcmp(endpoints[3].zone, "sh") == 0, "endpoints sorted by name");
+
+	const int kSamples = 200000;
+	std::map<std::string, int> hits;
+	for (int i = 0; i < kSamples; ++i) {
+		if (registry.Pick(&first)) {
+			++hits[first.address];
+		}
+	}
+	Check(hits["c:1"] == 0 && hits["a:1"] + hits["b:1"] + hits["d:1"] == kSamples, "pick never returns zero weight");
+	Check(Near(hits["a:1"], kSamples, 0.1) && Near(hits["b:1"], kSamples, 0.3) && Near(hits["d:1"], kSamples, 0.6),
+			"pick follows weights");
+
+	// PickTwo：第一个按权重，第二个在其余实例中按权重
+	std::map<std::string, int> first_hits;
+	std::map<std::string, std::map<std::string, int> > second_hits;
+	bool distinct = true;
+	for (int i = 0; i < kSamples; ++i) {
+		if (!registry.PickTwo(&first, &second) || strcmp(first.address, second.address) == 0) {
+			distinct = false;
+			continue;
+		}
+		++first_hits[first.address];
+		++second_hits[first.address][second.address];
+	}
+	Check(distinct && first_hits["c:1"] == 0, "pick two returns two distinct weighted endpoints");
+	Check(Near(first_hits["a:1"], kSamples, 0.1) && Near(first_hits["b:1"], kSamples, 0.3) &&
+			Near(first_hits["d:1"], kSamples, 0.6), "first of two follows weights");
+	// 第一个是d时，第二个在a、b中按1:3选择；第一个是a时，在b、d中按3:6选择
+	std::map<std::string, int>& after_d = second_hits["d:1"];
+	std::map<std::string, int>& after_a = second_hits["a:1"];
+	Check(after_d["c:1"] == 0 && after_a["c:1"] == 0 && second_hits["b:1"]["c:1"] == 0, "second never returns zero weight");
+	Check(Near(after_d["a:1"], first_hits["d:1"], 0.25) && Near(after_d["b:1"], first_hits["d:1"], 0.75) &&
+			Near(after_a["b:1"], first_hits["a:1"], 1.0 / 3) && Near(after_a["d:1"], first_hits["a:1"], 2.0 / 3),
+			"second follows remaining weights");
+
+	// 增量更新：删除和新增之后只剩新列表里的实例
+	children.erase(children.begin());
+	children.push_back(Name("e:1", 4));
+	registry.Update(children);
+	hits.clear();
+	for (int i = 0; i < 10000; ++i) {
+		if (registry.Pick(&first)) {
+			++hits[first.address];
+		}
+	}
+	Check(registry.GetEndpoints(&endpoints) == 4 && hits["d:1"] == 0 && hits["e:1"] > 0 && hits["c:1"] == 0,
+			"update replaces snapshot");
+
+	printf("%s\n", failures ? "FAILED" : "ALL PASSED");
+	return failures ? -1 : 0;
+}
@@ -0,0 +1,143 @@
+/*
+ * sequence_test.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+
+/**
+ *
+ * 	ZKSequenceIndex的测试，不需要连接zk：覆盖新增、删除、乱序的子节点列表，以及与std::map实现的随机对比。
+ *
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <map>
+#include <string>
+#include <vector>
+#include "zksequence.h"
+
+namespace {
+	int failures = 0;
+
+	void Check(bool ok, const char* what) {
+		printf("%s %s\n", ok ? "PASS" : "FAIL", what);
+		if (!ok) {
+			++failures;
+		}
+	}
+
+	std::string NodeName(int64_t seq) {
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "node-%010lld", (long long)seq);
+		return buffer;
+	}
+
+	int Update(ZKSequenceIndex* index, const std::vector<std::string>& children, std::vector<std::string>* added = NULL,
+			std::vector<std::string>* removed = NULL) {
+		std::vector<char*> names(children.size());
+		for (size_t i = 0; i < children.size(); ++i) {
+			names[i] = (char*)children[i].c_str();
+		}
+		return index->Update(names.size(), names.empty() ? NULL : &names[0], added, removed);
+	}
+
+	// 索引内容与期望的序号完全一致，并且名字能取回
+	bool Same(const ZKSequenceIndex& index, const std::map<int64_t, std::string>& expected) {
+		if (index.Size() != (int)expected.size()) {
+			return false;
+		}
+		int i = 0;
+		for (std::map<int64_t, std::string>::const_iterator iter = expected.begin(); iter != expected.end(); ++iter, ++i) {
+			if (index.SeqAt(i) != iter->first || iter->second != index.NameAt(i)) {
+				return false;
+			}
+		}
+		return true;
+	}
+}
+
+int main(int argc, char** argv) {
+	ZKSequenceIndex index;
+	std::vector<std::string> children;
+	std::vector<std::string> added, removed;
+
+	// 乱序的列表，非顺序节点被忽略
+	children.push_back(NodeName(5));
+	children.push_back(NodeName(1));
+	children.push_back("lock");
+	children.push_back(NodeName(3));
+	Check(Update(&index, children, &added, &removed) == 3 && added.size() == 3 && removed.empty(), "initial update");
+	Check(index.Size() == 3 && index.SeqAt(index.Min()) == 1 && NodeName(1) == index.NameAt(index.Min()), "min after unordered list");
+	Check(added[0] == NodeName(1) && added[1] == NodeName(3) && added[2] == NodeName(5), "added in sequence order");
+
+	// 列表没有变化
+	added.clear();
+	Check(Update(&index, children, &added, &removed) == 0 && added.empty(), "unchanged list");
+
+	// 同时新增和删除，新增的序号插在中间和两端
+	children.clear();
+	children.push_back(NodeName(7));
+	children.push_back(NodeName(3));
+	children.push_back(NodeName(0));
+	children.push_back(NodeName(4));
+	added.clear();
+	removed.clear();
+	Check(Update(&index, children, &added, &removed) == 5 && added.size() == 3 && removed.size() == 2, "add and remove");
+	Check(removed[0] == NodeName(1) && removed[1] == NodeName(5), "removed in sequence order");
+	std::map<int64_t, std::string> expected;
+	expected[0] = NodeName(0);
+	expected[3] = NodeName(3);
+	expected[4] = NodeName(4);
+	expected[7] = NodeName(7);
+	Check(Same(index, expected), "contents after add and remove");
+	Check(index.Predecessor(4) >= 0 && index.SeqAt(index.Predecessor(4)) == 3 && index.SeqAt(index.Successor(4)) == 7 &&
+			index.Successor(7) < 0 && index.Predecessor(0) < 0, "predecessor and successor");
+
+	// 全部删除
+	children.clear();
+	children.push_back("lock");
+	Check(Update(&index, children) == 4 && index.Size() == 0 && index.Min() < 0, "no sequential children");
+
+	// 与std::map随机对比，覆盖名字压缩
+	srand(argc > 1 ? atoi(argv[1]) : 1);
+	expected.clear();
+	bool same = true;
+	for (int round = 0; round < 2000 && same; ++round) {
+		std::map<int64_t, std::string> latest;
+		for (std::map<int64_t, std::string>::iterator iter = expected.begin(); iter != expected.end(); ++iter) {
+			if (rand() % 4) {
+				latest.insert(*iter);
+			}
+		}
+		for (int i = rand() % 8; i > 0; --i) {
+			int64_t seq = rand() % 200;
+			latest[seq] = NodeName(seq);
+		}
+		children.clear();
+		for (std::map<int64_t, std::string>::iterator iter = latest.begin(); iter != latest.end(); ++iter) {
+			children.push_back(iter->second);
+		}
+		for (size_t i = children.size(); i > 1; --i) { // 打乱顺序
+			std::swap(children[i - 1], children[rand() % i]);
+		}
+		added.clear();
+		removed.clear();
+		int changes = Update(&index, children, &added, &removed);
+		int diff = 0;
+		for (std::map<int64_t, std::string>::iterator iter = latest.begin(); iter != latest.end(); ++iter) {
+			diff += expected.count(iter->first) ? 0 : 1;
+		}
+		for (std::map<int64_t, std::string>::iterator iter = expected.begin(); iter != expected.end(); ++iter) {
+			diff += latest.count(iter->first) ? 0 : 1;
+		}
+		expected.swap(latest);
+		same = Same(index, expected) && changes == diff && (int)(added.size() + removed.size()) == diff;
+	}
+	Check(same, "random updates match std::map");
+
+	printf("%s\n", failures ? "FAILED" : "ALL PASSED");
+	return failures ? -1 : 0;
+}
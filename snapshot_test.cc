@@ -0,0 +1,135 @@
+/*
+ * snapshot_test.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+
+/**
+ *
+ * 	ZKSnapshot的测试，不需要连接zk：覆盖写入后加载的往返、空数据和空列表，以及截断、改写、校验和不对的文件被拒绝。
+ *
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include "zkclient.h"
+#include "zksnapshot.h"
+
+namespace {
+	int failures = 0;
+
+	void Check(bool ok, const char* what) {
+		printf("%s %s\n", ok ? "PASS" : "FAIL", what);
+		if (!ok) {
+			++failures;
+		}
+	}
+
+	struct Stat MakeStat(int64_t czxid, int64_t mzxid, int64_t pzxid) {
+		struct Stat stat;
+		memset(&stat, 0, sizeof(stat));
+		stat.czxid = czxid;
+		stat.mzxid = mzxid;
+		stat.pzxid = pzxid;
+		return stat;
+	}
+
+	bool ReadFile(const std::string& file, std::string* data) {
+		FILE* fp = fopen(file.c_str(), "rb");
+		if (!fp) {
+			return false;
+		}
+		char buffer[4096];
+		size_t len;
+		data->clear();
+		while ((len = fread(buffer, 1, sizeof(buffer), fp)) > 0) {
+			data->append(buffer, len);
+		}
+		fclose(fp);
+		return true;
+	}
+
+	bool WriteFile(const std::string& file, const std::string& data) {
+		FILE* fp = fopen(file.c_str(), "wb");
+		if (!fp) {
+			return false;
+		}
+		bool ok = fwrite(data.data(), 1, data.size(), fp) == data.size();
+		return fclose(fp) == 0 && ok;
+	}
+
+	// 改写文件内容后加载，期望被拒绝
+	bool Rejected(const std::string& file, const std::string& data) {
+		ZKSnapshot snapshot;
+		return WriteFile(file, data) && !snapshot.Load(file) && snapshot.Size() == 0;
+	}
+}
+
+int main(int argc, char** argv) {
+	char file[64];
+	snprintf(file, sizeof(file), "./snapshot_test.%d", (int)getpid());
+
+	std::string buffer;
+	std::string binary("a\0b\0c", 5); // 数据里可以有'\0'
+	std::vector<std::string> children;
+	children.push_back("node-1");
+	children.push_back("lock");
+	children.push_back("node-2");
+	ZKSnapshot::AppendNode(&buffer, "/config", binary, MakeStat(1, 5, 1));
+	ZKSnapshot::AppendNode(&buffer, "/empty", "", MakeStat(2, 2, 2));
+	ZKSnapshot::AppendChildren(&buffer, "/config", children, MakeStat(1, 5, 9));
+	ZKSnapshot::AppendChildren(&buffer, "/leaf", std::vector<std::string>(), MakeStat(3, 3, 3));
+	Check(ZKSnapshot::Save(file, buffer, 4), "save");
+
+	// 往返
+	ZKSnapshot snapshot;
+	Check(snapshot.Load(file) && snapshot.Size() == 4, "load");
+	const ZKSnapshotRecord* record = snapshot.Find(kZKWatchNode, "/config");
+	Check(record && record->value_len == 5 && memcmp(record->value, binary.data(), 5) == 0 &&
+			record->stat.mzxid == 5, "node with binary value");
+	record = snapshot.Find(kZKWatchNode, "/empty");
+	Check(record && record->value_len == 0 && record->stat.czxid == 2, "node with empty value");
+	record = snapshot.Find(kZKWatchChildren, "/config");
+	Check(record && record->children.size() == 3 && strcmp(record->children[0], "node-1") == 0 &&
+			strcmp(record->children[1], "lock") == 0 && strcmp(record->children[2], "node-2") == 0 &&
+			record->stat.pzxid == 9, "children in order");
+	record = snapshot.Find(kZKWatchChildren, "/leaf");
+	Check(record && record->children.empty() && record->stat.pzxid == 3, "empty children list");
+	Check(!snapshot.Find(kZKWatchChildren, "/empty") && !snapshot.Find(kZKWatchNode, "/missing"), "lookup by type and path");
+
+	// 再次加载替换之前的内容
+	std::string small;
+	ZKSnapshot::AppendNode(&small, "/only", "x", MakeStat(7, 7, 7));
+	Check(ZKSnapshot::Save(file, small, 1) && snapshot.Load(file) && snapshot.Size() == 1 &&
+			snapshot.Find(kZKWatchNode, "/only") && !snapshot.Find(kZKWatchNode, "/config"), "reload replaces records");
+
+	// 损坏的文件
+	Check(ZKSnapshot::Save(file, buffer, 4), "save again");
+	std::string data;
+	Check(ReadFile(file, &data) && data.size() > 64, "read back");
+	const size_t header_len = 32;
+	std::string corrupt = data;
+	corrupt[header_len + 40] ^= 0x01; // 记录内容被改写，校验和对不上
+	Check(Rejected(file, corrupt), "checksum mismatch rejected");
+	corrupt = data;
+	corrupt[0] = 'X';
+	Check(Rejected(file, corrupt), "bad magic rejected");
+	Check(Rejected(file, data.substr(0, data.size() - 8)), "truncated body rejected");
+	Check(Rejected(file, data.substr(0, header_len - 1)), "truncated header rejected");
+	Check(Rejected(file, data + std::string(8, '\0')), "trailing bytes rejected");
+	Check(Rejected(file, ""), "empty file rejected");
+
+	// 记录数与实际不符，即使校验和正确也拒绝
+	Check(ZKSnapshot::Save(file, buffer, 5) && !snapshot.Load(file), "record count mismatch rejected");
+
+	unlink(file);
+	Check(!snapshot.Load(file), "missing file");
+
+	printf("%s\n", failures ? "FAILED" : "ALL PASSED");
+	return failures ? -1 : 0;
+}
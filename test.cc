@@ -8,6 +8,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include "zkclient.h"
+#include "zkidallocator.h"
+#include "zkregistry.h"
+#include "zksubtree.h"
 
 void TestGetNodeHandler(ZKErrorCode errcode, const std::string& path, const char* value, int value_len, void* context) {
 	if (errcode == kZKSucceed) {
@@ -64,6 +67,8 @@ void TestSetHandler(ZKErrorCode errcode, const std::string& path, const struct S
 		printf("TestSetHandler-[kZKError] path=%s\n", path.c_str());
 	} else if (errcode == kZKNotExist) {
 		printf("TestSetHandler-[kZKNotExist] path=%s\n", path.c_str());
+	} else if (errcode == kZKBadVersion) {
+		printf("TestSetHandler-[kZKBadVersion] path=%s\n", path.c_str());
 	}
 }
 
@@ -142,9 +147,49 @@ int main(int argc, char** argv) {
 	errcode = zkclient.Set("/test", "sync set by zkclient~~~");
 	printf("Sync Set returns %d\n", errcode);
 
+	std::string value;
+	struct Stat stat;
+	errcode = zkclient.GetNode("/test", &value, &stat);
+	printf("Sync GetNode returns %d, value=%s version=%d\n", errcode, value.c_str(), stat.version);
+	if (errcode == kZKSucceed) {
+		errcode = zkclient.Set("/test", "cas set by zkclient~~~", stat.version);
+		printf("Sync CAS Set returns %d\n", errcode);
+	}
+
 	errcode = zkclient.Delete("/test");
 	printf("Sync Delete returns %d\n", errcode);
 
+	ZKIdAllocator id_allocator("/test_id", 1000);
+	if (id_allocator.Init()) {
+		for (int i = 0; i < 3; ++i) {
+			int64_t id;
+			if (id_allocator.Next(&id)) {
+				printf("IdAllocator Next id=%lld\n", (long long)id);
+			}
+		}
+	}
+
+	ZKServiceRegistry registry("/test_service");
+	errcode = registry.Advertise("127.0.0.1:8080", 100, "local");
+	printf("ServiceRegistry Advertise returns %d\n", errcode);
+	if (registry.Subscribe()) {
+		ZKEndpoint first, second;
+		if (registry.PickTwo(&first, &second)) {
+			printf("ServiceRegistry PickTwo %s(weight=%d) %s(weight=%d)\n", first.address, first.weight,
+					second.address, second.weight);
+		}
+	}
+
+	ZKSubtreeWatcher subtree_watcher("/test_service");
+	if (subtree_watcher.Start()) {
+		std::vector<ZKChangeEvent> events;
+		int count = subtree_watcher.Poll(&events, 100, 1000);
+		for (int i = 0; i < count; ++i) {
+			printf("SubtreeWatcher event type=%d path=%s zxid=%lld\n", events[i].type, events[i].path.c_str(),
+					(long long)events[i].zxid);
+		}
+	}
+
 	while (true) {
 		sleep(1);
 	}
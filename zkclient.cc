@@ -7,17 +7,152 @@
 
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <algorithm>
 #include "zkclient.h"
+#include "zksnapshot.h"
 
 pthread_once_t ZKClient::new_instance_once_ = PTHREAD_ONCE_INIT;
 
+ZKOperation::ZKOperation(ZKOperationType type, const std::string& path, const std::string& value, int flags,
+		int version) {
+	this->type = type;
+	this->path = path;
+	this->value = value;
+	this->flags = flags;
+	this->version = version;
+	this->errcode = kZKError;
+}
+
 ZKWatchContext::ZKWatchContext(const std::string& path, void* context, ZKClient* zkclient, bool watch) {
 	this->watch = watch;
 	this->path = path;
 	this->context = context;
 	this->zkclient = zkclient;
+	this->min_interval_ms = 0;
+	this->delay_ms = 0;
+	this->notify_ms = 0;
+	this->change_ms = 0;
+	this->due_ms = 0;
+	this->notify_versioned = false;
+	memset(&this->notify_stat, 0, sizeof(this->notify_stat));
+}
+
+ZKWatchEntry::ZKWatchEntry(ZKWatchType type, const std::string& path, ZKClient* zkclient) {
+	this->type = type;
+	this->path = path;
+	this->zkclient = zkclient;
+	this->armed = false;
+	this->dispatching = false;
+	this->inflight = 0;
+	this->rearming = 0;
+	this->cached = false;
+	memset(&this->stat, 0, sizeof(this->stat));
+	this->stale = NULL;
+}
+
+// 一次共享watch的异步拉取，refresh表示由watch事件触发，结果需要通知所有订阅者
+struct ZKClient::WatchFetch {
+	zhandle_t* zhandle;
+	ZKWatchEntry* entry;
+	bool refresh;
+};
+
+// 会话重建后需要重新创建的临时节点的Create请求
+struct ZKClient::EphemeralCreate {
+	ZKWatchContext* watch_ctx;
+	std::string value;
+};
+
+// 共享watch拉取到的结果，按watch类型使用对应字段
+struct ZKClient::WatchResult {
+	explicit WatchResult(ZKErrorCode errcode)
+		: errcode(errcode), value(NULL), value_len(0), count(0), data(NULL), stat(NULL) {}
+
+	ZKErrorCode errcode;
+	const char* value;
+	int value_len;
+	int count;
+	char** data;
+	const struct Stat* stat;
+};
+
+namespace {
+	bool SameHandler(ZKWatchType type, const ZKWatchContext* lhs, const ZKWatchContext* rhs) {
+		if (lhs->context != rhs->context) {
+			return false;
+		}
+		if (type == kZKWatchNode) {
+			return lhs->getnode_handler == rhs->getnode_handler;
+		} else if (type == kZKWatchChildren) {
+			return lhs->getchildren_handler == rhs->getchildren_handler;
+		}
+		return lhs->exist_handler == rhs->exist_handler;
+	}
+
+	// 持有读锁期间zhandle_不会被替换
+	class HandleGuard {
+	public:
+		explicit HandleGuard(pthread_rwlock_t* lock) : lock_(lock) {
+			pthread_rwlock_rdlock(lock_);
+		}
+		~HandleGuard() {
+			pthread_rwlock_unlock(lock_);
+		}
+	private:
+		pthread_rwlock_t* lock_;
+	};
+
+	ZKErrorCode OperationErrorCode(int rc) {
+		if (rc == ZOK) {
+			return kZKSucceed;
+		} else if (rc == ZNONODE) {
+			return kZKNotExist;
+		} else if (rc == ZNODEEXISTS) {
+			return kZKExisted;
+		} else if (rc == ZNOTEMPTY) {
+			return kZKNotEmpty;
+		} else if (rc == ZBADVERSION) {
+			return kZKBadVersion;
+		}
+		return kZKError;
+	}
+
+	// zk上注册watch时context只是watch类型，事件到达时再按(类型, path)查找entry。
+	// zk client对同一watcher+context去重，事件无法区分消耗的是哪一次注册，entry释放后仍可能收到事件，不能用entry指针
+	void* WatcherContext(ZKWatchType type) {
+		return (void*)(intptr_t)type;
+	}
+
+	// server延迟探测：单次探测最多阻塞的时间；耗时不超过最近server的2倍加0.5毫秒都算近
+	const int kProbeTimeoutMs = 500;
+	const int kProbeNearRatio = 2;
+	const int kProbeNearSlackUs = 500;
+
+	// 请求失败是因为会话已过期，或者zhandle正在被关闭
+	bool SessionLost(zhandle_t* zhandle, int rc) {
+		return rc == ZCLOSING || rc == ZSESSIONEXPIRED || rc == ZINVALIDSTATE ||
+				zoo_state(zhandle) == ZOO_EXPIRED_SESSION_STATE;
+	}
+
+	bool SameVersion(ZKWatchType type, const struct Stat& lhs, const struct Stat& rhs) {
+		if (type == kZKWatchChildren) {
+			return lhs.czxid == rhs.czxid && lhs.pzxid == rhs.pzxid;
+		}
+		return lhs.czxid == rhs.czxid && lhs.mzxid == rhs.mzxid;
+	}
+
+	// lhs比rhs新（节点重建或者有更晚的修改）
+	bool NewerVersion(ZKWatchType type, const struct Stat& lhs, const struct Stat& rhs) {
+		if (lhs.czxid != rhs.czxid) {
+			return lhs.czxid > rhs.czxid;
+		}
+		return type == kZKWatchChildren ? lhs.pzxid > rhs.pzxid : lhs.mzxid > rhs.mzxid;
+	}
 }
 
 ZKClient& ZKClient::GetInstance() {
@@ -36,26 +171,91 @@ ZKClient& ZKClient::GetClient() {
 
 ZKClient::ZKClient()
 	: zhandle_(NULL), log_fp_(NULL), expired_handler_(DefaultSessionExpiredHandler),  user_context_(NULL),
-	  session_state_(ZOO_CONNECTING_STATE), session_check_running_(false) {
+	  session_state_(ZOO_CONNECTING_STATE), session_save_ms_(0), session_resumed_(false), session_established_(false),
+	  session_renewed_(false),
+	  retired_handle_(NULL), snapshot_interval_ms_(1000), snapshot_save_ms_(0), snapshot_dirty_(false), snapshot_(NULL),
+	  probe_interval_ms_(0), probe_ms_(0), probe_streak_(0), servers_restricted_(false),
+	  probe_running_(false),
+	  session_rebuild_(false), session_replaced_(false), replaced_handler_(NULL), replaced_context_(NULL),
+	  session_check_running_(false) {
 	pthread_mutex_init(&state_mutex_, NULL);
 	pthread_cond_init(&state_cond_, NULL);
+
+	// 读优先：持有watch锁的回调线程可以随时拿到读锁，替换zhandle_时只短暂持有写锁
+	pthread_rwlockattr_t rwlock_attr;
+	pthread_rwlockattr_init(&rwlock_attr);
+	pthread_rwlockattr_setkind_np(&rwlock_attr, PTHREAD_RWLOCK_PREFER_READER_NP);
+	pthread_rwlock_init(&handle_lock_, &rwlock_attr);
+	pthread_rwlockattr_destroy(&rwlock_attr);
+
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&watch_mutex_, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	pthread_mutex_init(&ephemeral_mutex_, NULL);
+	pthread_mutex_init(&probe_mutex_, NULL);
 }
 
 ZKClient::~ZKClient() {
+	if (probe_running_) { // 终止延迟探测线程
+		probe_running_ = false;
+		pthread_join(probe_tid_, NULL);
+	}
 	if (session_check_running_) { // 终止会话检测线程
 		session_check_running_ = false;
 		pthread_join(session_check_tid_, NULL);
 	}
 	if (zhandle_) {
 		zookeeper_close(zhandle_);
+		// 会话已经主动关闭，不能再被恢复
+		if (!session_file_.empty()) {
+			unlink(session_file_.c_str());
+		}
 	}
 	if (log_fp_) {
 		fclose(log_fp_);
 	}
+	// 会话已关闭，不会再有watch回调，释放所有共享watch
+	for (WatchEntryMap::iterator iter = watch_entries_.begin(); iter != watch_entries_.end(); ++iter) {
+		ZKWatchEntry* entry = iter->second;
+		entry->subscribers.splice(entry->subscribers.end(), entry->pending);
+		entry->subscribers.splice(entry->subscribers.end(), entry->canceled);
+		for (std::list<ZKWatchContext*>::iterator ctx_iter = entry->subscribers.begin();
+				ctx_iter != entry->subscribers.end(); ++ctx_iter) {
+			delete *ctx_iter;
+		}
+		delete entry;
+	}
+	delete snapshot_;
+	pthread_mutex_destroy(&probe_mutex_);
+	pthread_mutex_destroy(&ephemeral_mutex_);
+	pthread_mutex_destroy(&watch_mutex_);
+	pthread_rwlock_destroy(&handle_lock_);
 	pthread_cond_destroy(&state_cond_);
 	pthread_mutex_destroy(&state_mutex_);
 }
 
+void ZKClient::SetSessionFile(const std::string& session_file) {
+	session_file_ = session_file;
+}
+
+void ZKClient::SetSnapshotFile(const std::string& snapshot_file, int interval_ms) {
+	snapshot_file_ = snapshot_file;
+	snapshot_interval_ms_ = interval_ms;
+}
+
+void ZKClient::SetLatencyProbe(int interval_ms) {
+	probe_interval_ms_ = interval_ms > 0 ? interval_ms : 60000;
+}
+
+void ZKClient::SetSessionRebuild(SessionReplacedHandler handler, void* context) {
+	session_rebuild_ = true;
+	replaced_handler_ = handler;
+	replaced_context_ = context;
+}
+
 bool ZKClient::Init(const std::string& host, int timeout, SessionExpiredHandler expired_handler, void* context,
 		 bool debug, const std::string& zklog) {
 	// 用户配置
@@ -80,28 +280,36 @@ bool ZKClient::Init(const std::string& host, int timeout, SessionExpiredHandler
 	// 存在一个非常罕见的BUG场景：就是zookeeper_init返回赋值到zhandle_之前就完成了到
 	// zookeeper的连接并回调了SessionWatcher，所以在SessionWatcher里一定要注意不要依赖
 	// zhandle_，而是使用SessionWatcher被传入的zhandle参数。
-	zhandle_ = zookeeper_init(host.c_str(), SessionWatcher, timeout, NULL, this, 0);
+	//
+	// 开启了会话持久化并且上次的会话可能还活着，则带上clientid尝试恢复原会话。
+	host_ = host;
+	// 开启了延迟探测，则按延迟排序host列表，并让zk client按顺序而不是随机选择server
+	if (probe_interval_ms_ > 0 && ZKLatencyProbe::ParseHosts(host, &probe_hosts_, &probe_chroot_)) {
+		ZKLatencyProbe::Probe(&probe_hosts_, kProbeTimeoutMs);
+		probe_ms_ = GetCurrentMs();
+		host_ = ZKLatencyProbe::JoinHosts(probe_hosts_, probe_chroot_);
+		zoo_deterministic_conn_order(1);
+	}
+	clientid_t clientid;
+	session_resumed_ = LoadSessionId(&clientid);
+	zhandle_ = zookeeper_init(host_.c_str(), SessionWatcher, timeout, session_resumed_ ? &clientid : NULL, this, 0);
 	if (!zhandle_) {
 		return false;
 	}
-	/*
-	 * 等待session初始化完成，两种可能返回值：
-	 * 1，连接成功，会话建立。
-	 * 2，会话过期，在初始化期间很难发生，场景：连接成功后io线程cpu卡住，导致zkserver一段时间没有收到心跳，会话超时了，
-	 * 然后cpu恢复运转，connected的watch事件开始处理更新了session_state然后cond_signal，然而init线程cpu卡住了，
-	 * 然后zkserver挂了，然后io线程重连了另外一个zkserver，然而session过期了，然后返回我们session_expire的，然后
-	 * session_expire的watch事件更新了session_state，然后init线程cpu正常了，然后看见了expire_session这个状态。
-	 * （天哪，真的有这种牛逼的巧合吗。。。只是比较严谨而已~）
-	 */
-	pthread_mutex_lock(&state_mutex_);
-	while (session_state_ != ZOO_CONNECTED_STATE &&
-			session_state_ != ZOO_EXPIRED_SESSION_STATE) {
-		pthread_cond_wait(&state_cond_, &state_mutex_);
-	}
-	int session_state = session_state_;
-	pthread_mutex_unlock(&state_mutex_);
-	if (session_state == ZOO_EXPIRED_SESSION_STATE) { // 会话过期，fatal级错误
-		return false;
+	// 快照加载成功则热启动，不等待会话建立，由会话检测线程处理恢复会话失败的情况
+	if (!LoadSnapshot()) {
+		int session_state = WaitSessionState();
+		if (session_state == ZOO_EXPIRED_SESSION_STATE && session_resumed_) {
+			// 持久化的会话已经过期，放弃恢复，建立新会话
+			if (!RenewSession()) {
+				return false;
+			}
+			session_state = WaitSessionState();
+		}
+		if (session_state == ZOO_EXPIRED_SESSION_STATE) { // 会话过期，fatal级错误
+			return false;
+		}
+		SaveSessionId();
 	}
 	/*
 	 * 会话建立，可以启动一个zk状态检测线程，主要是发现2种问题：
@@ -111,13 +319,21 @@ bool ZKClient::Init(const std::string& host, int timeout, SessionExpiredHandler
 	 */
 	session_check_running_ = true;
 	pthread_create(&session_check_tid_, NULL, SessionCheckThreadMain, this);
+#if ZOO_MAJOR_VERSION > 3 || ZOO_MINOR_VERSION >= 5
+	// 探测最多阻塞kProbeTimeoutMs，放在单独的线程里，不耽误会话检测线程。
+	// 3.4没有zoo_set_servers，定期探测无法迁移连接，只用Init时的探测结果
+	if (!probe_hosts_.empty()) {
+		probe_running_ = true;
+		pthread_create(&probe_tid_, NULL, ProbeThreadMain, this);
+	}
+#endif
 	return true;
 }
 
 void ZKClient::GetNodeDataCompletion(int rc, const char* value, int value_len,
         const struct Stat* stat, const void* data) {
 	assert(rc == ZOK || rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT ||
-			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING);
+			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING || rc == ZSESSIONEXPIRED);
 
 	const ZKWatchContext* watch_ctx = (const ZKWatchContext*)data;
 
@@ -137,56 +353,35 @@ void ZKClient::GetNodeDataCompletion(int rc, const char* value, int value_len,
 	delete watch_ctx;
 }
 
-void ZKClient::GetNodeWatcher(zhandle_t* zh, int type, int state, const char* path,void* watcher_ctx) {
-	assert(type == ZOO_DELETED_EVENT || type == ZOO_CHANGED_EVENT
-			|| type == ZOO_NOTWATCHING_EVENT || type == ZOO_SESSION_EVENT);
-
-	ZKWatchContext* context = (ZKWatchContext*)watcher_ctx;
-
-	if (type == ZOO_SESSION_EVENT) { // 跳过会话事件,由zk handler的watcher进行处理
-		return;
-	}
-
-	if (type == ZOO_DELETED_EVENT) {
-		context->getnode_handler(kZKDeleted, context->path, NULL, 0, context->context);
-		delete context;
-	} else {
-		if (type == ZOO_CHANGED_EVENT) {
-			int rc = zoo_awget(zh, context->path.c_str(), GetNodeWatcher, context, GetNodeDataCompletion, context);
-			if (rc == ZOK) {
-				return;
-			}
-		} else if (type == ZOO_NOTWATCHING_EVENT) {
-			// nothing to do
-		}
-		context->getnode_handler(kZKError, context->path, NULL, 0, context->context);
-		delete context;
-	}
-}
-
 bool ZKClient::GetNode(const std::string& path, GetNodeHandler handler, void* context, bool watch) {
-	watcher_fn watcher = watch ? GetNodeWatcher : NULL;
+	HandleGuard guard(&handle_lock_);
 
 	ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, watch);
 	watch_ctx->getnode_handler = handler;
 
-	int rc = zoo_awget(zhandle_, path.c_str(), watcher, watch_ctx, GetNodeDataCompletion, watch_ctx);
+	if (watch) { // 同一path的watch由所有订阅者共享
+		return Subscribe(kZKWatchNode, watch_ctx);
+	}
+	int rc = zoo_awget(zhandle_, path.c_str(), NULL, NULL, GetNodeDataCompletion, watch_ctx);
 	return rc == ZOK ? true : false;
 }
 
 bool ZKClient::GetChildren(const std::string& path, GetChildrenHandler handler, void* context, bool watch) {
-	watcher_fn watcher = watch ? GetChildrenWatcher : NULL;
+	HandleGuard guard(&handle_lock_);
 
 	ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, watch);
 	watch_ctx->getchildren_handler = handler;
 
-	int rc = zoo_awget_children(zhandle_, path.c_str(), watcher, watch_ctx, GetChildrenStringCompletion, watch_ctx);
+	if (watch) { // 同一path的watch由所有订阅者共享
+		return Subscribe(kZKWatchChildren, watch_ctx);
+	}
+	int rc = zoo_awget_children(zhandle_, path.c_str(), NULL, NULL, GetChildrenStringCompletion, watch_ctx);
 	return rc == ZOK ? true : false;
 }
 
 void ZKClient::GetChildrenStringCompletion(int rc, const struct String_vector* strings, const void* data) {
 	assert(rc == ZOK || rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT ||
-			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING);
+			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING || rc == ZSESSIONEXPIRED);
 
 	const ZKWatchContext* watch_ctx = (const ZKWatchContext*)data;
 
@@ -206,46 +401,22 @@ void ZKClient::GetChildrenStringCompletion(int rc, const struct String_vector* s
 	delete watch_ctx;
 }
 
-void ZKClient::GetChildrenWatcher(zhandle_t* zh, int type, int state, const char* path,void* watcher_ctx) {
-	assert(type == ZOO_DELETED_EVENT || type == ZOO_CHILD_EVENT
-			|| type == ZOO_NOTWATCHING_EVENT || type == ZOO_SESSION_EVENT);
-
-	ZKWatchContext* context = (ZKWatchContext*)watcher_ctx;
-
-	if (type == ZOO_SESSION_EVENT) { // 跳过会话事件,由zk handler的watcher进行处理
-		return;
-	}
-
-	if (type == ZOO_DELETED_EVENT) {
-		context->getchildren_handler(kZKDeleted, context->path, 0, NULL, context->context);
-		delete context;
-	} else {
-		if (type == ZOO_CHILD_EVENT) {
-			int rc = zoo_awget_children(zh, context->path.c_str(), GetChildrenWatcher, context, GetChildrenStringCompletion, context);
-			if (rc == ZOK) {
-				return;
-			}
-		} else if (type == ZOO_NOTWATCHING_EVENT) {
-			// nothing to do
-		}
-		context->getchildren_handler(kZKError, context->path, 0, NULL, context->context);
-		delete context;
-	}
-}
-
 bool ZKClient::Exist(const std::string& path, ExistHandler handler, void* context, bool watch) {
-	watcher_fn watcher = watch ? ExistWatcher : NULL;
+	HandleGuard guard(&handle_lock_);
 
 	ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, watch);
 	watch_ctx->exist_handler = handler;
 
-	int rc = zoo_awexists(zhandle_, path.c_str(), watcher, watch_ctx, ExistCompletion, watch_ctx);
+	if (watch) { // 同一path的watch由所有订阅者共享
+		return Subscribe(kZKWatchExist, watch_ctx);
+	}
+	int rc = zoo_awexists(zhandle_, path.c_str(), NULL, NULL, ExistCompletion, watch_ctx);
 	return rc == ZOK ? true : false;
 }
 
 void ZKClient::ExistCompletion(int rc, const struct Stat* stat, const void* data) {
 	assert(rc == ZOK || rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT ||
-			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING);
+			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING || rc == ZSESSIONEXPIRED);
 
 	const ZKWatchContext* watch_ctx = (const ZKWatchContext*)data;
 
@@ -261,41 +432,40 @@ void ZKClient::ExistCompletion(int rc, const struct Stat* stat, const void* data
 	delete watch_ctx;
 }
 
-void ZKClient::ExistWatcher(zhandle_t* zh, int type, int state, const char* path, void* watcher_ctx) {
-	assert(type == ZOO_DELETED_EVENT || type == ZOO_CREATED_EVENT || type == ZOO_CHANGED_EVENT
-			|| type == ZOO_NOTWATCHING_EVENT || type == ZOO_SESSION_EVENT);
-
-	ZKWatchContext* context = (ZKWatchContext*)watcher_ctx;
+bool ZKClient::Create(const std::string& path, const std::string& value, int flags, CreateHandler handler, void* context) {
+	HandleGuard guard(&handle_lock_);
 
-	if (type == ZOO_SESSION_EVENT) { // 跳过会话事件,由zk handler的watcher进行处理
-		return;
-	}
+	ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, false);
+	watch_ctx->create_handler = handler;
 
-	if (type == ZOO_NOTWATCHING_EVENT) {
-		context->exist_handler(kZKError, context->path, NULL, context->context);
-	} else if (type == ZOO_DELETED_EVENT) {
-		context->exist_handler(kZKDeleted, context->path, NULL, context->context);
-	} else if (type == ZOO_CREATED_EVENT || type == ZOO_CHANGED_EVENT) { // 节点创建或者元信息变动,重新获取通知用户
-		int rc = zoo_awexists(zh, context->path.c_str(), ExistWatcher, context, ExistCompletion, context);
-		if (rc == ZOK) {
-			return;
+	int rc;
+	if (session_rebuild_ && (flags & ZOO_EPHEMERAL) && !(flags & ZOO_SEQUENCE)) { // 创建成功后登记，会话重建时重新创建
+		EphemeralCreate* create = new EphemeralCreate;
+		create->watch_ctx = watch_ctx;
+		create->value = value;
+		rc = zoo_acreate(zhandle_, path.c_str(), value.c_str(), value.size(), &ZOO_OPEN_ACL_UNSAFE, flags,
+				EphemeralCreateCompletion, create);
+		if (rc != ZOK) {
+			delete create;
 		}
-		context->exist_handler(kZKError, context->path, NULL, context->context);
+	} else {
+		rc = zoo_acreate(zhandle_, path.c_str(), value.c_str(), value.size(), &ZOO_OPEN_ACL_UNSAFE, flags, CreateCompletion, watch_ctx);
 	}
-	delete context;
+	return rc == ZOK ? true : false;
 }
 
-bool ZKClient::Create(const std::string& path, const std::string& value, int flags, CreateHandler handler, void* context) {
-	ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, false);
-	watch_ctx->create_handler = handler;
-
-	int rc = zoo_acreate(zhandle_, path.c_str(), value.c_str(), value.size(), &ZOO_OPEN_ACL_UNSAFE, flags, CreateCompletion, watch_ctx);
-	return rc == ZOK ? true : false;
+void ZKClient::EphemeralCreateCompletion(int rc, const char* value, const void* data) {
+	EphemeralCreate* create = (EphemeralCreate*)data;
+	if (rc == ZOK) {
+		create->watch_ctx->zkclient->AddEphemeralNode(create->watch_ctx->path, create->value);
+	}
+	CreateCompletion(rc, value, create->watch_ctx);
+	delete create;
 }
 
 void ZKClient::CreateCompletion(int rc, const char* value, const void* data) {
 	assert(rc == ZOK || rc == ZNODEEXISTS || rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT ||
-			rc == ZNOAUTH || rc == ZNONODE || rc == ZNOCHILDRENFOREPHEMERALS || rc == ZCLOSING);
+			rc == ZNOAUTH || rc == ZNONODE || rc == ZNOCHILDRENFOREPHEMERALS || rc == ZCLOSING || rc == ZSESSIONEXPIRED);
 
 	const ZKWatchContext* watch_ctx = (const ZKWatchContext*)data;
 	if (rc == ZOK) {
@@ -310,23 +480,27 @@ void ZKClient::CreateCompletion(int rc, const char* value, const void* data) {
 	delete watch_ctx;
 }
 
-bool ZKClient::Set(const std::string& path, const std::string& value, SetHandler handler, void* context) {
+bool ZKClient::Set(const std::string& path, const std::string& value, SetHandler handler, void* context, int version) {
+	HandleGuard guard(&handle_lock_);
+
 	ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, false);
 	watch_ctx->set_handler = handler;
 
-	int rc = zoo_aset(zhandle_, path.c_str(), value.c_str(), value.size(), -1, SetCompletion, watch_ctx);
+	int rc = zoo_aset(zhandle_, path.c_str(), value.c_str(), value.size(), version, SetCompletion, watch_ctx);
 	return rc == ZOK ? true : false;
 }
 
 void ZKClient::SetCompletion(int rc, const struct Stat* stat, const void* data) {
 	assert(rc == ZOK || rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT || rc == ZBADVERSION ||
-			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING);
+			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING || rc == ZSESSIONEXPIRED);
 
 	const ZKWatchContext* watch_ctx = (const ZKWatchContext*)data;
 	if (rc == ZOK) {
 		watch_ctx->set_handler(kZKSucceed, watch_ctx->path, stat, watch_ctx->context);
 	} else if (rc == ZNONODE) {
 		watch_ctx->set_handler(kZKNotExist, watch_ctx->path, NULL, watch_ctx->context);
+	} else if (rc == ZBADVERSION) {
+		watch_ctx->set_handler(kZKBadVersion, watch_ctx->path, NULL, watch_ctx->context);
 	} else {
 		watch_ctx->set_handler(kZKError, watch_ctx->path, NULL, watch_ctx->context);
 	}
@@ -334,6 +508,8 @@ void ZKClient::SetCompletion(int rc, const struct Stat* stat, const void* data)
 }
 
 bool ZKClient::Delete(const std::string& path, DeleteHandler handler, void* context) {
+	HandleGuard guard(&handle_lock_);
+
 	ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, false);
 	watch_ctx->delete_handler = handler;
 
@@ -343,9 +519,12 @@ bool ZKClient::Delete(const std::string& path, DeleteHandler handler, void* cont
 
 void ZKClient::DeleteCompletion(int rc, const void* data) {
 	assert(rc == ZOK || rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT || rc == ZBADVERSION ||
-			rc == ZNOAUTH || rc == ZNONODE || rc == ZNOTEMPTY || rc == ZCLOSING);
+			rc == ZNOAUTH || rc == ZNONODE || rc == ZNOTEMPTY || rc == ZCLOSING || rc == ZSESSIONEXPIRED);
 
 	const ZKWatchContext* watch_ctx = (const ZKWatchContext*)data;
+	if (rc == ZOK || rc == ZNONODE) {
+		watch_ctx->zkclient->RemoveEphemeralNode(watch_ctx->path);
+	}
 	if (rc == ZOK) {
 		watch_ctx->delete_handler(kZKSucceed, watch_ctx->path, watch_ctx->context);
 	} else if (rc == ZNONODE) {
@@ -360,14 +539,14 @@ void ZKClient::DeleteCompletion(int rc, const void* data) {
 
 ZKErrorCode ZKClient::GetNode(const std::string& path, char* buffer, int* buffer_len, GetNodeHandler handler,
 		void* context, bool watch) {
-	watcher_fn watcher = watch ? GetNodeWatcher : NULL;
+	HandleGuard guard(&handle_lock_);
 
-	ZKWatchContext* watch_ctx = NULL;
 	if (watch) {
-		watch_ctx = new ZKWatchContext(path, context, this, watch);
+		ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, watch);
 		watch_ctx->getnode_handler = handler;
+		return SubscribeSync(kZKWatchNode, watch_ctx, buffer, buffer_len, NULL, NULL);
 	}
-	int rc = zoo_wget(zhandle_, path.c_str(), watcher, watch_ctx, buffer, buffer_len, NULL);
+	int rc = zoo_wget(zhandle_, path.c_str(), NULL, NULL, buffer, buffer_len, NULL);
 	if (rc == ZOK) {
 		return kZKSucceed;
 	} else if (rc == ZNONODE) {
@@ -376,17 +555,43 @@ ZKErrorCode ZKClient::GetNode(const std::string& path, char* buffer, int* buffer
 	return kZKError;
 }
 
+ZKErrorCode ZKClient::GetNode(const std::string& path, std::string* value, struct Stat* stat) {
+	HandleGuard guard(&handle_lock_);
+
+	struct Stat node_stat;
+	std::vector<char> buffer(1024);
+	for (;;) {
+		int buffer_len = buffer.size();
+		int rc = zoo_wget(zhandle_, path.c_str(), NULL, NULL, &buffer[0], &buffer_len, &node_stat);
+		if (rc == ZNONODE) {
+			return kZKNotExist;
+		} else if (rc != ZOK) {
+			return kZKError;
+		}
+		// 缓冲区不够时zk截断数据，按节点实际大小重新读取
+		if (node_stat.dataLength <= (int)buffer.size()) {
+			value->assign(&buffer[0], buffer_len > 0 ? buffer_len : 0);
+			break;
+		}
+		buffer.resize(node_stat.dataLength);
+	}
+	if (stat) {
+		*stat = node_stat;
+	}
+	return kZKSucceed;
+}
+
 ZKErrorCode ZKClient::GetChildren(const std::string& path, std::vector<std::string>* value, GetChildrenHandler handler,
 		void* context, bool watch) {
-	watcher_fn watcher = watch ? GetChildrenWatcher : NULL;
+	HandleGuard guard(&handle_lock_);
 
-	ZKWatchContext* watch_ctx = NULL;
 	if (watch) {
-		watch_ctx = new ZKWatchContext(path, context, this, watch);
+		ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, watch);
 		watch_ctx->getchildren_handler = handler;
+		return SubscribeSync(kZKWatchChildren, watch_ctx, NULL, NULL, value, NULL);
 	}
 	struct String_vector strings = { 0, NULL };
-	int rc = zoo_wget_children(zhandle_, path.c_str(), watcher, watch_ctx, &strings);
+	int rc = zoo_wget_children(zhandle_, path.c_str(), NULL, NULL, &strings);
 	if (rc == ZOK) {
 		for (int i = 0; i < strings.count; ++i) {
 			value->push_back(strings.data[i]);
@@ -400,14 +605,14 @@ ZKErrorCode ZKClient::GetChildren(const std::string& path, std::vector<std::stri
 }
 
 ZKErrorCode ZKClient::Exist(const std::string& path, struct Stat* stat, ExistHandler handler, void* context, bool watch) {
-	watcher_fn watcher = watch ? ExistWatcher : NULL;
+	HandleGuard guard(&handle_lock_);
 
-	ZKWatchContext* watch_ctx = NULL;
 	if (watch) {
-		watch_ctx = new ZKWatchContext(path, context, this, watch);
+		ZKWatchContext* watch_ctx = new ZKWatchContext(path, context, this, watch);
 		watch_ctx->exist_handler = handler;
+		return SubscribeSync(kZKWatchExist, watch_ctx, NULL, NULL, NULL, stat);
 	}
-	int rc = zoo_wexists(zhandle_, path.c_str(), watcher, watch_ctx, stat);
+	int rc = zoo_wexists(zhandle_, path.c_str(), NULL, NULL, stat);
 	if (rc == ZOK) {
 		return kZKSucceed;
 	} else if (rc == ZNONODE) {
@@ -417,8 +622,13 @@ ZKErrorCode ZKClient::Exist(const std::string& path, struct Stat* stat, ExistHan
 }
 
 ZKErrorCode ZKClient::Create(const std::string& path, const std::string& value, int flags, char* path_buffer, int path_buffer_len) {
+	HandleGuard guard(&handle_lock_);
+
 	int rc = zoo_create(zhandle_, path.c_str(), value.c_str(), value.size(), &ZOO_OPEN_ACL_UNSAFE, flags, path_buffer, path_buffer_len);
 	if (rc == ZOK) {
+		if (session_rebuild_ && (flags & ZOO_EPHEMERAL) && !(flags & ZOO_SEQUENCE)) {
+			AddEphemeralNode(path, value);
+		}
 		return kZKSucceed;
 	} else if (rc == ZNONODE) {
 		return kZKNotExist;
@@ -428,18 +638,27 @@ ZKErrorCode ZKClient::Create(const std::string& path, const std::string& value,
 	return kZKError;
 }
 
-ZKErrorCode ZKClient::Set(const std::string& path, const std::string& value) {
-	int rc = zoo_set(zhandle_, path.c_str(), value.c_str(), value.size(), -1);
+ZKErrorCode ZKClient::Set(const std::string& path, const std::string& value, int version, struct Stat* stat) {
+	HandleGuard guard(&handle_lock_);
+
+	int rc = zoo_set2(zhandle_, path.c_str(), value.c_str(), value.size(), version, stat);
 	if (rc == ZOK) {
 		return kZKSucceed;
 	} else if (rc == ZNONODE) {
 		return kZKNotExist;
+	} else if (rc == ZBADVERSION) {
+		return kZKBadVersion;
 	}
 	return kZKError;
 }
 
 ZKErrorCode ZKClient::Delete(const std::string& path) {
+	HandleGuard guard(&handle_lock_);
+
 	int rc = zoo_delete(zhandle_, path.c_str(), -1);
+	if (rc == ZOK || rc == ZNONODE) {
+		RemoveEphemeralNode(path);
+	}
 	if (rc == ZOK) {
 		return kZKSucceed;
 	} else if (rc == ZNONODE) {
@@ -450,6 +669,828 @@ ZKErrorCode ZKClient::Delete(const std::string& path) {
 	return kZKError;
 }
 
+ZKErrorCode ZKClient::Multi(std::vector<ZKOperation>* ops) {
+	if (ops->empty()) {
+		return kZKSucceed;
+	}
+	std::vector<zoo_op_t> zoo_ops(ops->size());
+	std::vector<zoo_op_result_t> results(ops->size());
+	std::vector<std::vector<char> > path_buffers(ops->size());
+	for (size_t i = 0; i < ops->size(); ++i) {
+		const ZKOperation& op = (*ops)[i];
+		memset(&results[i], 0, sizeof(results[i]));
+		if (op.type == kZKOpCreate) {
+			path_buffers[i].resize(op.path.size() + 16); // 留出顺序节点的10位序号
+			zoo_create_op_init(&zoo_ops[i], op.path.c_str(), op.value.c_str(), op.value.size(), &ZOO_OPEN_ACL_UNSAFE,
+					op.flags, &path_buffers[i][0], path_buffers[i].size());
+		} else if (op.type == kZKOpDelete) {
+			zoo_delete_op_init(&zoo_ops[i], op.path.c_str(), op.version);
+		} else if (op.type == kZKOpSet) {
+			zoo_set_op_init(&zoo_ops[i], op.path.c_str(), op.value.c_str(), op.value.size(), op.version, NULL);
+		} else {
+			zoo_check_op_init(&zoo_ops[i], op.path.c_str(), op.version);
+		}
+	}
+
+	HandleGuard guard(&handle_lock_);
+
+	int rc = zoo_multi(zhandle_, ops->size(), &zoo_ops[0], &results[0]);
+	ZKErrorCode errcode = rc == ZOK ? kZKSucceed : kZKError;
+	for (size_t i = 0; i < ops->size(); ++i) {
+		ZKOperation& op = (*ops)[i];
+		if (rc != ZOK) { // 只有导致失败的操作有具体错误码，其余操作都被回滚
+			op.errcode = results[i].err == rc ? OperationErrorCode(rc) : kZKError;
+			if (results[i].err == rc) {
+				errcode = op.errcode;
+			}
+			continue;
+		}
+		op.errcode = kZKSucceed;
+		if (op.type == kZKOpCreate) {
+			op.created_path.assign(&path_buffers[i][0]);
+			if (session_rebuild_ && (op.flags & ZOO_EPHEMERAL) && !(op.flags & ZOO_SEQUENCE)) {
+				AddEphemeralNode(op.path, op.value);
+			}
+		} else if (op.type == kZKOpDelete) {
+			RemoveEphemeralNode(op.path);
+		}
+	}
+	return errcode;
+}
+
+ZKWatchEntry* ZKClient::GetWatchEntry(ZKWatchType type, const std::string& path) {
+	std::pair<int, std::string> key(type, path);
+	WatchEntryMap::iterator iter = watch_entries_.find(key);
+	if (iter != watch_entries_.end()) {
+		return iter->second;
+	}
+	ZKWatchEntry* entry = new ZKWatchEntry(type, path, this);
+	watch_entries_.insert(std::make_pair(key, entry));
+	// 热启动期间，先关联快照里的数据
+	if (snapshot_) {
+		pthread_mutex_lock(&state_mutex_);
+		bool session_established = session_established_;
+		pthread_mutex_unlock(&state_mutex_);
+		if (!session_established) {
+			entry->stale = snapshot_->Find(type, path);
+		}
+	}
+	return entry;
+}
+
+void ZKClient::ReleaseWatchEntry(ZKWatchEntry* entry) {
+	// zk上的watch仍可能回调，或者还有请求/订阅者引用，不能释放
+	if (entry->armed || entry->dispatching || entry->inflight || entry->rearming ||
+			!entry->subscribers.empty() || !entry->pending.empty()) {
+		return;
+	}
+	watch_entries_.erase(std::make_pair((int)entry->type, entry->path));
+	delayed_entries_.erase(entry);
+	if (entry->cached) { // 不再watch的数据从快照中移除
+		snapshot_dirty_ = true;
+	}
+	delete entry;
+}
+
+int ZKClient::FetchWatchEntry(zhandle_t* zhandle, ZKWatchEntry* entry, bool refresh) {
+	WatchFetch* fetch = new WatchFetch;
+	fetch->zhandle = zhandle;
+	fetch->entry = entry;
+	fetch->refresh = refresh;
+
+	int rc;
+	const char* path = entry->path.c_str();
+	if (entry->type == kZKWatchNode) {
+		rc = zoo_awget(zhandle, path, WatchEntryWatcher, WatcherContext(entry->type), WatchNodeCompletion, fetch);
+	} else if (entry->type == kZKWatchChildren) {
+		rc = zoo_awget_children2(zhandle, path, WatchEntryWatcher, WatcherContext(entry->type), WatchChildrenCompletion, fetch);
+	} else {
+		rc = zoo_awexists(zhandle, path, WatchEntryWatcher, WatcherContext(entry->type), WatchExistCompletion, fetch);
+	}
+	if (rc == ZOK) {
+		++entry->inflight;
+	} else {
+		delete fetch;
+	}
+	return rc;
+}
+
+int ZKClient::RearmWatchEntry(zhandle_t* zhandle, ZKWatchEntry* entry) {
+	WatchFetch* fetch = new WatchFetch;
+	fetch->zhandle = zhandle;
+	fetch->entry = entry;
+	fetch->refresh = false;
+
+	// 节点存在时注册的是数据watch，不存在时注册的是exist watch，都会在下次变化时触发
+	int rc = zoo_awexists(zhandle, entry->path.c_str(), WatchEntryWatcher, WatcherContext(entry->type), WatchRearmCompletion, fetch);
+	if (rc == ZOK) {
+		++entry->rearming;
+	} else {
+		delete fetch;
+	}
+	return rc;
+}
+
+bool ZKClient::Subscribe(ZKWatchType type, ZKWatchContext* watch_ctx) {
+	pthread_mutex_lock(&watch_mutex_);
+	ZKWatchEntry* entry = GetWatchEntry(type, watch_ctx->path);
+	entry->pending.push_back(watch_ctx);
+	// 已有拉取在途则搭车等待其结果，否则发起一次带watch的拉取
+	int rc = ZOK;
+	if (!entry->inflight) {
+		rc = FetchWatchEntry(zhandle_, entry, false);
+	}
+	if (rc != ZOK) {
+		entry->pending.remove(watch_ctx);
+		delete watch_ctx;
+		ReleaseWatchEntry(entry);
+	} else if (entry->stale && !entry->cached) { // 热启动期间，先用快照里的数据回调
+		const ZKSnapshotRecord* record = entry->stale;
+		WatchResult result(kZKStale);
+		result.value = record->value;
+		result.value_len = record->value_len;
+		result.count = record->children.size();
+		result.data = result.count ? const_cast<char**>(&record->children[0]) : NULL;
+		result.stat = &record->stat;
+
+		bool dispatching = entry->dispatching;
+		entry->dispatching = true;
+		InvokeHandler(entry, watch_ctx, result);
+		entry->dispatching = dispatching;
+		if (!dispatching) { // 回调期间可能取消了订阅
+			for (std::list<ZKWatchContext*>::iterator iter = entry->canceled.begin(); iter != entry->canceled.end(); ++iter) {
+				delete *iter;
+			}
+			entry->canceled.clear();
+			ReleaseWatchEntry(entry);
+		}
+	}
+	pthread_mutex_unlock(&watch_mutex_);
+	return rc == ZOK ? true : false;
+}
+
+ZKErrorCode ZKClient::SubscribeSync(ZKWatchType type, ZKWatchContext* watch_ctx, char* buffer, int* buffer_len,
+		std::vector<std::string>* children, struct Stat* stat) {
+	// 先加入订阅者并标记watch生效：同步调用期间如果watch已经触发，会照常重新拉取，不会丢失后续变化
+	pthread_mutex_lock(&watch_mutex_);
+	ZKWatchEntry* entry = GetWatchEntry(type, watch_ctx->path);
+	entry->subscribers.push_back(watch_ctx);
+	entry->armed = true;
+	pthread_mutex_unlock(&watch_mutex_);
+
+	// 同步调用会等待zk的回调线程，不能持有watch锁；期间订阅可能被取消，不能再访问watch_ctx和entry
+	int rc;
+	std::string watch_path = watch_ctx->path;
+	const char* path = watch_path.c_str();
+	struct Stat sync_stat; // 节点不存在时版本为全0
+	memset(&sync_stat, 0, sizeof(sync_stat));
+	struct String_vector strings = { 0, NULL };
+	if (type == kZKWatchNode) {
+		rc = zoo_wget(zhandle_, path, WatchEntryWatcher, WatcherContext(type), buffer, buffer_len, &sync_stat);
+	} else if (type == kZKWatchChildren) {
+		rc = zoo_wget_children2(zhandle_, path, WatchEntryWatcher, WatcherContext(type), &strings, &sync_stat);
+		if (rc == ZOK) {
+			for (int i = 0; i < strings.count; ++i) {
+				children->push_back(strings.data[i]);
+			}
+		}
+	} else {
+		rc = zoo_wexists(zhandle_, path, WatchEntryWatcher, WatcherContext(type), &sync_stat);
+	}
+	if (stat && rc == ZOK) {
+		*stat = sync_stat;
+	}
+
+	if (rc != ZOK && (type != kZKWatchExist || rc != ZNONODE)) { // watch没有生效（可能已被用户取消订阅）
+		pthread_mutex_lock(&watch_mutex_);
+		// 同步调用期间entry可能已被释放，重新查找
+		WatchEntryMap::iterator entry_iter = watch_entries_.find(std::make_pair((int)type, watch_path));
+		if (entry_iter != watch_entries_.end()) {
+			entry = entry_iter->second;
+			std::list<ZKWatchContext*>::iterator iter =
+					std::find(entry->subscribers.begin(), entry->subscribers.end(), watch_ctx);
+			if (iter != entry->subscribers.end()) {
+				entry->subscribers.erase(iter);
+				delete watch_ctx;
+			}
+			// 没有其他订阅者时不再需要这个watch，清除生效标记并释放entry，否则缓存的数据会一直留着
+			if (entry->subscribers.empty()) {
+				entry->armed = false;
+				ReleaseWatchEntry(entry);
+			}
+		}
+		pthread_mutex_unlock(&watch_mutex_);
+	} else { // 与异步的首次拉取一样更新缓存，并记下通知过的版本
+		WatchResult result(rc == ZOK ? kZKSucceed : kZKNotExist);
+		if (rc == ZOK) {
+			result.stat = &sync_stat;
+		}
+		// 数据被截断时不能缓存，只记录版本
+		bool cacheable = type != kZKWatchNode || rc != ZOK || sync_stat.dataLength <= *buffer_len;
+		if (type == kZKWatchNode) {
+			result.value = buffer;
+			result.value_len = *buffer_len;
+		} else if (type == kZKWatchChildren) {
+			result.count = strings.count;
+			result.data = strings.data;
+		}
+		pthread_mutex_lock(&watch_mutex_);
+		WatchEntryMap::iterator entry_iter = watch_entries_.find(std::make_pair((int)type, watch_path));
+		if (entry_iter != watch_entries_.end()) {
+			entry = entry_iter->second;
+			// 同步调用期间watch可能已经触发并拉取到了更新的数据，只用不比缓存旧的结果更新缓存
+			if (cacheable && (!entry->cached || !NewerVersion(type, entry->stat, sync_stat))) {
+				UpdateWatchCache(entry, result);
+			}
+			std::list<ZKWatchContext*>::iterator iter =
+					std::find(entry->subscribers.begin(), entry->subscribers.end(), watch_ctx);
+			if (iter != entry->subscribers.end() && !watch_ctx->notify_versioned) {
+				watch_ctx->notify_versioned = true;
+				watch_ctx->notify_stat = sync_stat;
+			}
+		}
+		pthread_mutex_unlock(&watch_mutex_);
+	}
+	if (strings.data) {
+		deallocate_String_vector(&strings);
+	}
+	if (rc == ZOK) {
+		return kZKSucceed;
+	} else if (rc == ZNONODE) {
+		return kZKNotExist;
+	}
+	return kZKError;
+}
+
+bool ZKClient::Unwatch(const std::string& path, GetNodeHandler handler, void* context) {
+	ZKWatchContext key(path, context, this, true);
+	key.getnode_handler = handler;
+	return Unsubscribe(kZKWatchNode, key);
+}
+
+bool ZKClient::Unwatch(const std::string& path, GetChildrenHandler handler, void* context) {
+	ZKWatchContext key(path, context, this, true);
+	key.getchildren_handler = handler;
+	return Unsubscribe(kZKWatchChildren, key);
+}
+
+bool ZKClient::Unwatch(const std::string& path, ExistHandler handler, void* context) {
+	ZKWatchContext key(path, context, this, true);
+	key.exist_handler = handler;
+	return Unsubscribe(kZKWatchExist, key);
+}
+
+bool ZKClient::SetWatchPolicy(const std::string& path, GetNodeHandler handler, void* context, int min_interval_ms,
+		int delay_ms) {
+	ZKWatchContext key(path, context, this, true);
+	key.getnode_handler = handler;
+	return SetPolicy(kZKWatchNode, key, min_interval_ms, delay_ms);
+}
+
+bool ZKClient::SetWatchPolicy(const std::string& path, GetChildrenHandler handler, void* context, int min_interval_ms,
+		int delay_ms) {
+	ZKWatchContext key(path, context, this, true);
+	key.getchildren_handler = handler;
+	return SetPolicy(kZKWatchChildren, key, min_interval_ms, delay_ms);
+}
+
+bool ZKClient::SetWatchPolicy(const std::string& path, ExistHandler handler, void* context, int min_interval_ms,
+		int delay_ms) {
+	ZKWatchContext key(path, context, this, true);
+	key.exist_handler = handler;
+	return SetPolicy(kZKWatchExist, key, min_interval_ms, delay_ms);
+}
+
+bool ZKClient::SetPolicy(ZKWatchType type, const ZKWatchContext& key, int min_interval_ms, int delay_ms) {
+	pthread_mutex_lock(&watch_mutex_);
+	bool found = false;
+	WatchEntryMap::iterator entry_iter = watch_entries_.find(std::make_pair((int)type, key.path));
+	if (entry_iter != watch_entries_.end()) {
+		ZKWatchEntry* entry = entry_iter->second;
+		std::list<ZKWatchContext*>* lists[] = { &entry->subscribers, &entry->pending };
+		for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]) && !found; ++i) {
+			for (std::list<ZKWatchContext*>::iterator iter = lists[i]->begin(); iter != lists[i]->end(); ++iter) {
+				if (SameHandler(type, *iter, &key)) {
+					(*iter)->min_interval_ms = min_interval_ms > 0 ? min_interval_ms : 0;
+					(*iter)->delay_ms = delay_ms > 0 ? delay_ms : 0;
+					found = true;
+					break;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&watch_mutex_);
+	return found;
+}
+
+bool ZKClient::Unsubscribe(ZKWatchType type, const ZKWatchContext& key) {
+	pthread_mutex_lock(&watch_mutex_);
+	WatchEntryMap::iterator entry_iter = watch_entries_.find(std::make_pair((int)type, key.path));
+	if (entry_iter == watch_entries_.end()) {
+		pthread_mutex_unlock(&watch_mutex_);
+		return false;
+	}
+	ZKWatchEntry* entry = entry_iter->second;
+	ZKWatchContext* watch_ctx = NULL;
+	std::list<ZKWatchContext*>* lists[] = { &entry->subscribers, &entry->pending };
+	for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]) && !watch_ctx; ++i) {
+		for (std::list<ZKWatchContext*>::iterator iter = lists[i]->begin(); iter != lists[i]->end(); ++iter) {
+			if (SameHandler(type, *iter, &key)) {
+				watch_ctx = *iter;
+				lists[i]->erase(iter);
+				break;
+			}
+		}
+	}
+	if (watch_ctx) {
+		if (entry->dispatching) { // 正在回调订阅者，回调结束后再释放
+			watch_ctx->watch = false;
+			entry->canceled.push_back(watch_ctx);
+		} else {
+			delete watch_ctx;
+		}
+		// zk上的watch无法撤销，下次触发时发现没有订阅者便不再注册
+		ReleaseWatchEntry(entry);
+	}
+	pthread_mutex_unlock(&watch_mutex_);
+	return watch_ctx ? true : false;
+}
+
+void ZKClient::InvokeHandler(const ZKWatchEntry* entry, const ZKWatchContext* watch_ctx, const WatchResult& result) {
+	if (entry->type == kZKWatchNode) {
+		watch_ctx->getnode_handler(result.errcode, watch_ctx->path, result.value, result.value_len, watch_ctx->context);
+	} else if (entry->type == kZKWatchChildren) {
+		watch_ctx->getchildren_handler(result.errcode, watch_ctx->path, result.count, result.data, watch_ctx->context);
+	} else {
+		watch_ctx->exist_handler(result.errcode, watch_ctx->path, result.stat, watch_ctx->context);
+	}
+}
+
+void ZKClient::WatchEntryWatcher(zhandle_t* zh, int type, int state, const char* path, void* watcher_ctx) {
+	assert(type == ZOO_DELETED_EVENT || type == ZOO_CREATED_EVENT || type == ZOO_CHANGED_EVENT ||
+			type == ZOO_CHILD_EVENT || type == ZOO_NOTWATCHING_EVENT || type == ZOO_SESSION_EVENT);
+
+	if (type == ZOO_SESSION_EVENT) { // 跳过会话事件,由zk handler的watcher进行处理
+		return;
+	}
+	ZKClient::GetInstance().OnWatchEvent(zh, (ZKWatchType)(intptr_t)watcher_ctx, path, type);
+}
+
+void ZKClient::OnWatchEvent(zhandle_t* zhandle, ZKWatchType watch_type, const std::string& path, int type) {
+	pthread_mutex_lock(&watch_mutex_);
+	WatchEntryMap::iterator entry_iter = watch_entries_.find(std::make_pair((int)watch_type, path));
+	if (entry_iter == watch_entries_.end()) { // 已经没有订阅者，entry已释放
+		pthread_mutex_unlock(&watch_mutex_);
+		return;
+	}
+	ZKWatchEntry* entry = entry_iter->second;
+	// 一次watch注册只会回调一次
+	entry->armed = false;
+
+	std::list<ZKWatchContext*> finished; // watch失效，回调后释放
+	WatchResult result(kZKError);
+	if (type == ZOO_DELETED_EVENT) {
+		result.errcode = kZKDeleted;
+		UpdateWatchCache(entry, result);
+		finished.splice(finished.end(), entry->subscribers);
+	} else if (type == ZOO_NOTWATCHING_EVENT) {
+		finished.splice(finished.end(), entry->subscribers);
+	} else if (!entry->subscribers.empty()) { // 节点变化且仍有订阅者
+		// 有订阅者到了通知时间则拉取一次并重新注册watch，否则只重新注册watch，到时再拉取最新数据
+		// 等待首次数据的订阅者由在途的拉取负责，无需在这里处理
+		int rc;
+		int64_t now_ms = GetCurrentMs();
+		if (ScheduleNotify(entry, now_ms, false) <= now_ms) {
+			rc = FetchWatchEntry(zhandle, entry, true);
+		} else {
+			delayed_entries_.insert(entry);
+			rc = entry->type == kZKWatchChildren ? ZOK : RearmWatchEntry(zhandle, entry);
+		}
+		// 会话失效但会被替换时保留订阅者，新会话建立后重新拉取并注册watch
+		if (rc != ZOK && !(SessionLost(zhandle, rc) && SessionRenewing())) {
+			finished.splice(finished.end(), entry->subscribers);
+		}
+	}
+
+	entry->dispatching = true;
+	for (std::list<ZKWatchContext*>::iterator iter = finished.begin(); iter != finished.end(); ++iter) {
+		InvokeHandler(entry, *iter, result);
+		delete *iter;
+	}
+	entry->dispatching = false;
+	ReleaseWatchEntry(entry);
+	pthread_mutex_unlock(&watch_mutex_);
+}
+
+void ZKClient::OnWatchFetched(ZKWatchEntry* entry, bool refresh, bool session_lost, const WatchResult& result) {
+	pthread_mutex_lock(&watch_mutex_);
+	--entry->inflight;
+
+	std::list<ZKWatchContext*> targets; // 需要通知的订阅者
+	std::list<ZKWatchContext*> finished; // watch失效，回调后释放
+	if (result.errcode == kZKSucceed || (entry->type == kZKWatchExist && result.errcode == kZKNotExist)) {
+		// 与热启动时回调过的快照数据版本一致，等待首次数据的订阅者无需再通知
+		bool unchanged = entry->stale && result.stat && SameVersion(entry->type, entry->stale->stat, *result.stat);
+		UpdateWatchCache(entry, result);
+		struct Stat stat; // 节点不存在时版本为全0
+		if (result.stat) {
+			stat = *result.stat;
+		} else {
+			memset(&stat, 0, sizeof(stat));
+		}
+		// watch生效，等待首次数据的订阅者转为正式订阅者
+		entry->armed = true;
+		if (refresh) { // 只通知到了通知时间并且版本有变化的订阅者，其余的继续等待
+			int64_t now_ms = GetCurrentMs();
+			for (std::list<ZKWatchContext*>::iterator iter = entry->subscribers.begin();
+					iter != entry->subscribers.end(); ++iter) {
+				ZKWatchContext* watch_ctx = *iter;
+				if (watch_ctx->due_ms && watch_ctx->due_ms <= now_ms) {
+					watch_ctx->due_ms = 0;
+					watch_ctx->change_ms = 0;
+					if (!watch_ctx->notify_versioned || !SameVersion(entry->type, watch_ctx->notify_stat, stat)) {
+						watch_ctx->notify_ms = now_ms;
+						watch_ctx->notify_versioned = true;
+						watch_ctx->notify_stat = stat;
+						targets.push_back(watch_ctx);
+					}
+				} else if (watch_ctx->due_ms) {
+					delayed_entries_.insert(entry);
+				}
+			}
+		}
+		for (std::list<ZKWatchContext*>::iterator iter = entry->pending.begin(); iter != entry->pending.end(); ++iter) {
+			(*iter)->notify_versioned = true;
+			(*iter)->notify_stat = stat;
+			if (!unchanged) {
+				targets.push_back(*iter);
+			}
+		}
+		entry->subscribers.splice(entry->subscribers.end(), entry->pending);
+	} else if (session_lost && SessionRenewing()) {
+		// 会话失效但会被替换，保留所有订阅者，新会话建立后重新拉取并注册watch
+		entry->armed = false;
+	} else {
+		UpdateWatchCache(entry, result);
+		// 重新注册失败则所有订阅者的watch失效，否则只影响等待首次数据的订阅者
+		if (refresh) {
+			entry->armed = false;
+			finished.splice(finished.end(), entry->subscribers);
+		}
+		finished.splice(finished.end(), entry->pending);
+		targets = finished;
+	}
+
+	entry->dispatching = true;
+	for (std::list<ZKWatchContext*>::iterator iter = targets.begin(); iter != targets.end(); ++iter) {
+		if ((*iter)->watch) { // 跳过回调期间被取消的订阅者
+			InvokeHandler(entry, *iter, result);
+		}
+	}
+	entry->dispatching = false;
+
+	finished.splice(finished.end(), entry->canceled);
+	for (std::list<ZKWatchContext*>::iterator iter = finished.begin(); iter != finished.end(); ++iter) {
+		delete *iter;
+	}
+	ReleaseWatchEntry(entry);
+	pthread_mutex_unlock(&watch_mutex_);
+}
+
+void ZKClient::WatchNodeCompletion(int rc, const char* value, int value_len,
+		const struct Stat* stat, const void* data) {
+	assert(rc == ZOK || rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT ||
+			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING || rc == ZSESSIONEXPIRED);
+
+	WatchFetch* fetch = (WatchFetch*)data;
+	ZKWatchEntry* entry = fetch->entry;
+	bool refresh = fetch->refresh;
+	bool session_lost = SessionLost(fetch->zhandle, rc); // 回调期间zhandle仍然有效
+	delete fetch;
+
+	WatchResult result(kZKError);
+	if (rc == ZOK) {
+		result.errcode = kZKSucceed;
+		result.value = value;
+		result.value_len = value_len;
+		result.stat = stat;
+	} else if (rc == ZNONODE) {
+		result.errcode = kZKNotExist;
+	}
+	entry->zkclient->OnWatchFetched(entry, refresh, session_lost, result);
+}
+
+void ZKClient::WatchChildrenCompletion(int rc, const struct String_vector* strings, const struct Stat* stat,
+		const void* data) {
+	assert(rc == ZOK || rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT ||
+			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING || rc == ZSESSIONEXPIRED);
+
+	WatchFetch* fetch = (WatchFetch*)data;
+	ZKWatchEntry* entry = fetch->entry;
+	bool refresh = fetch->refresh;
+	bool session_lost = SessionLost(fetch->zhandle, rc); // 回调期间zhandle仍然有效
+	delete fetch;
+
+	WatchResult result(kZKError);
+	if (rc == ZOK) {
+		result.errcode = kZKSucceed;
+		result.count = strings->count;
+		result.data = strings->data;
+		result.stat = stat;
+	} else if (rc == ZNONODE) {
+		result.errcode = kZKNotExist;
+	}
+	entry->zkclient->OnWatchFetched(entry, refresh, session_lost, result);
+}
+
+void ZKClient::WatchExistCompletion(int rc, const struct Stat* stat, const void* data) {
+	assert(rc == ZOK || rc == ZCONNECTIONLOSS || rc == ZOPERATIONTIMEOUT ||
+			rc == ZNOAUTH || rc == ZNONODE || rc == ZCLOSING || rc == ZSESSIONEXPIRED);
+
+	WatchFetch* fetch = (WatchFetch*)data;
+	ZKWatchEntry* entry = fetch->entry;
+	bool refresh = fetch->refresh;
+	bool session_lost = SessionLost(fetch->zhandle, rc); // 回调期间zhandle仍然有效
+	delete fetch;
+
+	WatchResult result(kZKError);
+	if (rc == ZOK) {
+		result.errcode = kZKSucceed;
+		result.stat = stat;
+	} else if (rc == ZNONODE) {
+		result.errcode = kZKNotExist;
+	}
+	entry->zkclient->OnWatchFetched(entry, refresh, session_lost, result);
+}
+
+void ZKClient::WatchRearmCompletion(int rc, const struct Stat* stat, const void* data) {
+	WatchFetch* fetch = (WatchFetch*)data;
+	ZKWatchEntry* entry = fetch->entry;
+	delete fetch;
+	entry->zkclient->OnWatchRearmed(entry, rc);
+}
+
+void ZKClient::OnWatchRearmed(ZKWatchEntry* entry, int rc) {
+	pthread_mutex_lock(&watch_mutex_);
+	--entry->rearming;
+	if (rc == ZOK || rc == ZNONODE) {
+		entry->armed = true;
+	}
+	ReleaseWatchEntry(entry);
+	pthread_mutex_unlock(&watch_mutex_);
+}
+
+int ZKClient::CheckWatchEntry(zhandle_t* zhandle, ZKWatchEntry* entry) {
+	WatchFetch* fetch = new WatchFetch;
+	fetch->zhandle = zhandle;
+	fetch->entry = entry;
+	fetch->refresh = true;
+
+	int rc = zoo_awexists(zhandle, entry->path.c_str(), WatchEntryWatcher, WatcherContext(entry->type), WatchCheckCompletion, fetch);
+	if (rc == ZOK) {
+		++entry->rearming;
+	} else {
+		delete fetch;
+	}
+	return rc;
+}
+
+void ZKClient::WatchCheckCompletion(int rc, const struct Stat* stat, const void* data) {
+	WatchFetch* fetch = (WatchFetch*)data;
+	ZKWatchEntry* entry = fetch->entry;
+	zhandle_t* zhandle = fetch->zhandle;
+	delete fetch;
+	entry->zkclient->OnWatchChecked(zhandle, entry, rc, stat);
+}
+
+void ZKClient::OnWatchChecked(zhandle_t* zhandle, ZKWatchEntry* entry, int rc, const struct Stat* stat) {
+	pthread_mutex_lock(&watch_mutex_);
+	--entry->rearming;
+
+	// 所有订阅者都已经收到过这个版本，watch已经由exists重新注册，无需拉取和通知
+	bool unchanged = rc == ZOK && entry->pending.empty();
+	for (std::list<ZKWatchContext*>::iterator iter = entry->subscribers.begin();
+			iter != entry->subscribers.end() && unchanged; ++iter) {
+		unchanged = (*iter)->notify_versioned && SameVersion(entry->type, (*iter)->notify_stat, *stat);
+	}
+	if (unchanged) {
+		entry->armed = true;
+		for (std::list<ZKWatchContext*>::iterator iter = entry->subscribers.begin();
+				iter != entry->subscribers.end(); ++iter) {
+			(*iter)->due_ms = 0;
+			(*iter)->change_ms = 0;
+		}
+		ReleaseWatchEntry(entry);
+	} else { // 版本变化或者节点已经不存在，拉取数据并通知
+		int fetch_rc = FetchWatchEntry(zhandle, entry, true);
+		if (fetch_rc != ZOK) {
+			++entry->inflight;
+			OnWatchFetched(entry, true, SessionLost(zhandle, fetch_rc), WatchResult(kZKError));
+		}
+	}
+	pthread_mutex_unlock(&watch_mutex_);
+}
+
+int64_t ZKClient::ScheduleNotify(ZKWatchEntry* entry, int64_t now_ms, bool immediate) {
+	// 记录订阅者有未通知的变化，按各自的通知策略计算通知时间，返回最早的通知时间
+	int64_t earliest_ms = now_ms;
+	for (std::list<ZKWatchContext*>::iterator iter = entry->subscribers.begin(); iter != entry->subscribers.end(); ++iter) {
+		ZKWatchContext* watch_ctx = *iter;
+		if (!watch_ctx->change_ms) {
+			watch_ctx->change_ms = now_ms;
+		}
+		int64_t due_ms = now_ms;
+		if (!immediate && watch_ctx->delay_ms > 0) { // 防抖，持续变化时最多推迟到第一次变化后10倍delay_ms
+			due_ms = std::min(now_ms + watch_ctx->delay_ms, watch_ctx->change_ms + 10 * (int64_t)watch_ctx->delay_ms);
+		}
+		if (!immediate && watch_ctx->min_interval_ms > 0) { // 节流
+			due_ms = std::max(due_ms, watch_ctx->notify_ms + watch_ctx->min_interval_ms);
+		}
+		watch_ctx->due_ms = due_ms;
+		if (iter == entry->subscribers.begin() || due_ms < earliest_ms) {
+			earliest_ms = due_ms;
+		}
+	}
+	return earliest_ms;
+}
+
+void ZKClient::DispatchDelayedWatches() {
+	pthread_mutex_lock(&watch_mutex_);
+	if (delayed_entries_.empty()) {
+		pthread_mutex_unlock(&watch_mutex_);
+		return;
+	}
+	HandleGuard guard(&handle_lock_);
+
+	// 拉取失败时可能释放entry，先取出再逐个处理
+	int64_t now_ms = GetCurrentMs();
+	std::vector<ZKWatchEntry*> entries;
+	std::vector<bool> waiting_entries; // 对应的entry是否还有订阅者在等待通知
+	for (std::set<ZKWatchEntry*>::iterator iter = delayed_entries_.begin(); iter != delayed_entries_.end(); ++iter) {
+		ZKWatchEntry* entry = *iter;
+		bool waiting = false;
+		bool due = false;
+		for (std::list<ZKWatchContext*>::iterator ctx_iter = entry->subscribers.begin();
+				ctx_iter != entry->subscribers.end(); ++ctx_iter) {
+			if ((*ctx_iter)->due_ms) {
+				waiting = true;
+				due = due || (*ctx_iter)->due_ms <= now_ms;
+			}
+		}
+		if (due || !waiting) {
+			entries.push_back(entry);
+			waiting_entries.push_back(waiting);
+		}
+	}
+	for (size_t i = 0; i < entries.size(); ++i) {
+		ZKWatchEntry* entry = entries[i];
+		delayed_entries_.erase(entry);
+		if (entry->subscribers.empty()) { // 订阅者已经全部取消或失效
+			continue;
+		}
+		// 没有订阅者在等待（例如之后的watch事件已经通知过了），拉取结果不会通知任何人，
+		// 只有等待期间没有重新注册的子节点列表watch仍需要拉取一次来重新注册
+		if (!waiting_entries[i] && (entry->type != kZKWatchChildren || entry->armed || entry->inflight)) {
+			continue;
+		}
+		// 拉取最新数据并重新注册watch，结果只通知到了时间的订阅者
+		int rc = FetchWatchEntry(zhandle_, entry, true);
+		if (rc != ZOK) {
+			++entry->inflight;
+			OnWatchFetched(entry, true, SessionLost(zhandle_, rc), WatchResult(kZKError));
+		}
+	}
+	pthread_mutex_unlock(&watch_mutex_);
+}
+
+void ZKClient::UpdateWatchCache(ZKWatchEntry* entry, const WatchResult& result) {
+	if (entry->type == kZKWatchExist) {
+		return;
+	}
+	if (result.errcode == kZKSucceed) {
+		entry->cached = true;
+		entry->stat = *result.stat;
+		entry->stale = NULL;
+		if (entry->type == kZKWatchNode) {
+			entry->value.assign(result.value ? result.value : "", result.value_len > 0 ? result.value_len : 0);
+		} else {
+			entry->children.assign(result.data, result.data + result.count);
+		}
+		snapshot_dirty_ = true;
+	} else if (result.errcode == kZKNotExist || result.errcode == kZKDeleted) {
+		if (entry->cached) {
+			snapshot_dirty_ = true;
+		}
+		entry->cached = false;
+		entry->stale = NULL;
+		entry->value.clear();
+		entry->children.clear();
+	}
+}
+
+ZKErrorCode ZKClient::GetCachedNode(const std::string& path, std::string* value, struct Stat* stat) {
+	return GetCachedEntry(kZKWatchNode, path, value, NULL, stat);
+}
+
+ZKErrorCode ZKClient::GetCachedChildren(const std::string& path, std::vector<std::string>* children, struct Stat* stat) {
+	return GetCachedEntry(kZKWatchChildren, path, NULL, children, stat);
+}
+
+ZKErrorCode ZKClient::GetCachedEntry(ZKWatchType type, const std::string& path, std::string* value,
+		std::vector<std::string>* children, struct Stat* stat) {
+	pthread_mutex_lock(&watch_mutex_);
+	ZKErrorCode errcode = kZKNotExist;
+	const ZKSnapshotRecord* record = NULL;
+	WatchEntryMap::iterator iter = watch_entries_.find(std::make_pair((int)type, path));
+	if (iter != watch_entries_.end() && iter->second->cached) {
+		const ZKWatchEntry* entry = iter->second;
+		if (value) {
+			*value = entry->value;
+		}
+		if (children) {
+			*children = entry->children;
+		}
+		if (stat) {
+			*stat = entry->stat;
+		}
+		errcode = kZKSucceed;
+	} else if (iter != watch_entries_.end()) {
+		record = iter->second->stale;
+	} else if (snapshot_) {
+		pthread_mutex_lock(&state_mutex_);
+		bool session_established = session_established_;
+		pthread_mutex_unlock(&state_mutex_);
+		if (!session_established) {
+			record = snapshot_->Find(type, path);
+		}
+	}
+	if (record) {
+		if (value) {
+			value->assign(record->value, record->value_len);
+		}
+		if (children) {
+			children->assign(record->children.begin(), record->children.end());
+		}
+		if (stat) {
+			*stat = record->stat;
+		}
+		errcode = kZKStale;
+	}
+	pthread_mutex_unlock(&watch_mutex_);
+	return errcode;
+}
+
+bool ZKClient::LoadSnapshot() {
+	if (snapshot_file_.empty()) {
+		return false;
+	}
+	snapshot_ = new ZKSnapshot;
+	if (!snapshot_->Load(snapshot_file_) || !snapshot_->Size()) {
+		delete snapshot_;
+		snapshot_ = NULL;
+		return false;
+	}
+	return true;
+}
+
+void ZKClient::SaveSnapshot() {
+	std::string buffer;
+	uint32_t count = 0;
+
+	pthread_mutex_lock(&watch_mutex_);
+	if (!snapshot_dirty_) {
+		pthread_mutex_unlock(&watch_mutex_);
+		return;
+	}
+	snapshot_dirty_ = false;
+	for (WatchEntryMap::iterator iter = watch_entries_.begin(); iter != watch_entries_.end(); ++iter) {
+		const ZKWatchEntry* entry = iter->second;
+		if (entry->type == kZKWatchNode && entry->cached) {
+			ZKSnapshot::AppendNode(&buffer, entry->path, entry->value, entry->stat);
+		} else if (entry->type == kZKWatchNode && entry->stale) { // 还没拿到实时数据，保留快照里的数据
+			const ZKSnapshotRecord* record = entry->stale;
+			ZKSnapshot::AppendNode(&buffer, entry->path, std::string(record->value, record->value_len), record->stat);
+		} else if (entry->type == kZKWatchChildren && entry->cached) {
+			ZKSnapshot::AppendChildren(&buffer, entry->path, entry->children, entry->stat);
+		} else if (entry->type == kZKWatchChildren && entry->stale) {
+			const ZKSnapshotRecord* record = entry->stale;
+			std::vector<std::string> children(record->children.begin(), record->children.end());
+			ZKSnapshot::AppendChildren(&buffer, entry->path, children, record->stat);
+		} else {
+			continue;
+		}
+		++count;
+	}
+	pthread_mutex_unlock(&watch_mutex_);
+
+	snapshot_save_ms_ = GetCurrentMs();
+	if (!ZKSnapshot::Save(snapshot_file_, buffer, count)) { // 下次重试
+		pthread_mutex_lock(&watch_mutex_);
+		snapshot_dirty_ = true;
+		pthread_mutex_unlock(&watch_mutex_);
+	}
+}
+
 void ZKClient::DefaultSessionExpiredHandler(void* context) {
 	exit(0);
 }
@@ -467,11 +1508,144 @@ void ZKClient::SessionWatcher(zhandle_t *zh, int type, int state, const char *pa
 	zkclient->UpdateSessionState(zh, state);
 }
 
+bool ZKClient::RenewSession() {
+	// 先标记旧zhandle，忽略其后续的会话事件，再建立新会话
+	pthread_mutex_lock(&state_mutex_);
+	retired_handle_ = zhandle_;
+	session_state_ = ZOO_CONNECTING_STATE;
+	session_resumed_ = false;
+	session_established_ = false; // 新会话建立之前没有会话可以过期
+	session_renewed_ = true;
+	pthread_mutex_unlock(&state_mutex_);
+
+	pthread_mutex_lock(&probe_mutex_);
+	servers_restricted_ = false; // 新会话使用完整的server列表
+	std::string host = host_;
+	pthread_mutex_unlock(&probe_mutex_);
+	zhandle_t* zhandle = zookeeper_init(host.c_str(), SessionWatcher, session_timeout_, NULL, this, 0);
+	if (!zhandle) {
+		return false;
+	}
+	pthread_rwlock_wrlock(&handle_lock_);
+	zhandle_t* retired_handle = zhandle_;
+	zhandle_ = zhandle;
+	pthread_rwlock_unlock(&handle_lock_);
+
+	// 关闭旧zhandle会回调其上未完成的请求，不能持有任何锁
+	zookeeper_close(retired_handle);
+	pthread_mutex_lock(&state_mutex_);
+	retired_handle_ = NULL;
+	pthread_mutex_unlock(&state_mutex_);
+	return true;
+}
+
+bool ZKClient::SessionRenewing() {
+	pthread_mutex_lock(&state_mutex_);
+	bool renewing = session_rebuild_ || session_renewed_;
+	pthread_mutex_unlock(&state_mutex_);
+	return renewing;
+}
+
+void ZKClient::RearmWatches() {
+	pthread_mutex_lock(&watch_mutex_);
+	HandleGuard guard(&handle_lock_);
+
+	// 拉取失败时可能释放entry，先取出再逐个处理
+	std::vector<ZKWatchEntry*> entries;
+	for (WatchEntryMap::iterator iter = watch_entries_.begin(); iter != watch_entries_.end(); ++iter) {
+		ZKWatchEntry* entry = iter->second;
+		// 在新会话上已有在途拉取的首次订阅者无需处理
+		if (!entry->subscribers.empty() || (!entry->pending.empty() && !entry->inflight)) {
+			entries.push_back(entry);
+		}
+	}
+	for (size_t i = 0; i < entries.size(); ++i) {
+		ZKWatchEntry* entry = entries[i];
+		entry->armed = false; // 旧会话上的watch已经失效
+		ScheduleNotify(entry, GetCurrentMs(), true);
+		// 节点数据先用exists比较版本，没有变化就不再拉取数据
+		if (entry->type == kZKWatchNode && entry->pending.empty()) {
+			if (CheckWatchEntry(zhandle_, entry) == ZOK) {
+				continue;
+			}
+		}
+		// 按拉取失败处理：新会话又失效并且会被替换时保留订阅者，等下一次重建，否则通知所有订阅者watch失效
+		int rc = FetchWatchEntry(zhandle_, entry, true);
+		if (rc != ZOK) {
+			++entry->inflight;
+			OnWatchFetched(entry, true, SessionLost(zhandle_, rc), WatchResult(kZKError));
+		}
+	}
+	pthread_mutex_unlock(&watch_mutex_);
+}
+
+bool ZKClient::RecreateEphemeralNodes() {
+	pthread_mutex_lock(&ephemeral_mutex_);
+	std::map<std::string, std::string> ephemeral_nodes = ephemeral_nodes_;
+	pthread_mutex_unlock(&ephemeral_mutex_);
+
+	bool succeed = true;
+	for (std::map<std::string, std::string>::iterator iter = ephemeral_nodes.begin();
+			iter != ephemeral_nodes.end(); ++iter) {
+		// 父节点不存在则无法重建，不再重试
+		ZKErrorCode errcode = Create(iter->first, iter->second, ZOO_EPHEMERAL);
+		if (errcode == kZKError) {
+			succeed = false;
+		} else if (errcode == kZKExisted) {
+			// 节点已存在：属于本会话（例如上次重试时其实已经创建成功）视为成功，属于其他会话则记为冲突
+			struct Stat stat;
+			errcode = Exist(iter->first, &stat);
+			if (errcode != kZKSucceed) { // 查询失败或者刚好被删除，下次重试
+				succeed = false;
+			} else if (stat.ephemeralOwner != GetSessionId()) {
+				pthread_mutex_lock(&ephemeral_mutex_);
+				if (ephemeral_nodes_.erase(iter->first)) {
+					conflicted_nodes_.push_back(iter->first);
+				}
+				pthread_mutex_unlock(&ephemeral_mutex_);
+			}
+		}
+	}
+	return succeed;
+}
+
+void ZKClient::TakeConflictedEphemeralNodes(std::vector<std::string>* paths) {
+	pthread_mutex_lock(&ephemeral_mutex_);
+	paths->insert(paths->end(), conflicted_nodes_.begin(), conflicted_nodes_.end());
+	conflicted_nodes_.clear();
+	pthread_mutex_unlock(&ephemeral_mutex_);
+}
+
+int64_t ZKClient::GetSessionId() {
+	HandleGuard guard(&handle_lock_);
+	return zhandle_ ? zoo_client_id(zhandle_)->client_id : 0;
+}
+
+void ZKClient::AddEphemeralNode(const std::string& path, const std::string& value) {
+	pthread_mutex_lock(&ephemeral_mutex_);
+	ephemeral_nodes_[path] = value;
+	pthread_mutex_unlock(&ephemeral_mutex_);
+}
+
+void ZKClient::RemoveEphemeralNode(const std::string& path) {
+	if (!session_rebuild_) {
+		return;
+	}
+	pthread_mutex_lock(&ephemeral_mutex_);
+	ephemeral_nodes_.erase(path);
+	pthread_mutex_unlock(&ephemeral_mutex_);
+}
+
 void ZKClient::UpdateSessionState(zhandle_t* zhandle, int state) {
 	pthread_mutex_lock(&state_mutex_);
+	if (zhandle == retired_handle_) { // 已被替换的zhandle
+		pthread_mutex_unlock(&state_mutex_);
+		return;
+	}
 	session_state_ = state;
 	// 连接建立，记录协商后的会话过期时间，唤醒init函数（只有第一次有实际作用）
 	if (state == ZOO_CONNECTED_STATE) {
+		session_established_ = true;
 		session_timeout_ = zoo_recv_timeout(zhandle);
 		// printf("session_timeout=%ld\n", session_timeout_);
 		pthread_cond_signal(&state_cond_);
@@ -486,30 +1660,248 @@ void ZKClient::UpdateSessionState(zhandle_t* zhandle, int state) {
 }
 
 void ZKClient::CheckSessionState() {
+	bool ephemeral_pending = false; // 有临时节点因为网络原因没有重建成功，每秒重试一次
+	int64_t ephemeral_retry_ms = 0;
 	while (session_check_running_) {
 		bool session_expired = false;
+		bool session_renew = false;
+		bool session_rearm = false;
 		pthread_mutex_lock(&state_mutex_);
 		if (session_state_ == ZOO_EXPIRED_SESSION_STATE) {
-			session_expired = true;
-		} else if (session_state_ != ZOO_CONNECTED_STATE) {
+			// 热启动时恢复的会话已经过期，放弃恢复，建立新会话
+			if (!session_established_ && session_resumed_) {
+				session_renew = true;
+			} else {
+				session_expired = true;
+			}
+		} else if (session_state_ != ZOO_CONNECTED_STATE && session_established_) { // 会话建立之前没有会话可以过期
 			if (GetCurrentMs() - session_disconnect_ms_ > session_timeout_) {
 				session_expired = true;
 			}
 		}
+		bool session_connected = session_state_ == ZOO_CONNECTED_STATE;
+		int session_timeout = session_timeout_;
+		int64_t session_disconnect_ms = session_disconnect_ms_;
+		if (session_connected && session_renewed_) {
+			session_renewed_ = false;
+			session_rearm = true;
+		}
 		pthread_mutex_unlock(&state_mutex_);
+		if (session_expired && session_rebuild_) { // 开启了会话重建，替换会话而不是终结程序
+			session_expired = false;
+			session_renew = true;
+			session_replaced_ = true;
+		}
+		if (session_renew && !RenewSession()) {
+			session_expired = true;
+		}
 		if (session_expired) { // 会话过期，回调用户终结程序
 			return expired_handler_(user_context_); // 停止检测
 		}
+		// 替换后的新会话已经建立，重新注册watch，重建临时节点，然后通知用户
+		if (session_rearm) {
+			RearmWatches();
+			ephemeral_pending = !RecreateEphemeralNodes();
+			ephemeral_retry_ms = GetCurrentMs();
+			if (session_replaced_) {
+				session_replaced_ = false;
+				if (replaced_handler_) {
+					replaced_handler_(replaced_context_);
+				}
+			}
+		} else if (ephemeral_pending && session_connected && GetCurrentMs() - ephemeral_retry_ms >= 1000) {
+			ephemeral_pending = !RecreateEphemeralNodes();
+			ephemeral_retry_ms = GetCurrentMs();
+		}
+		// 会话正常，定期刷新持久化的会话保存时间，进程挂掉后据此判断会话是否可能还活着
+		if (session_connected && !session_file_.empty() &&
+				GetCurrentMs() - session_save_ms_ >= session_timeout / 3) {
+			SaveSessionId();
+		}
+		// 数据有变化，限频写快照
+		if (!snapshot_file_.empty() && GetCurrentMs() - snapshot_save_ms_ >= snapshot_interval_ms_) {
+			SaveSnapshot();
+		}
+		// 到了通知时间的延迟watch通知
+		DispatchDelayedWatches();
+		// 迁移到近的server后连接长时间断开，说明近的server不可用，恢复完整列表
+		if (probe_interval_ms_ > 0 && !session_connected && GetCurrentMs() - session_disconnect_ms >= session_timeout / 3) {
+			RestoreServers();
+		}
 		usleep(1000); // 睡眠1毫秒
 	}
 }
 
+void ZKClient::ProbeServers() {
+	while (probe_running_) {
+		if (GetCurrentMs() - probe_ms_ < probe_interval_ms_) {
+			usleep(10000); // 睡眠10毫秒，及时响应析构
+			continue;
+		}
+		probe_ms_ = GetCurrentMs();
+		// 不持锁探测，只在更新结果时短暂持锁
+		pthread_mutex_lock(&probe_mutex_);
+		std::vector<ZKHostLatency> hosts = probe_hosts_;
+		pthread_mutex_unlock(&probe_mutex_);
+		ZKLatencyProbe::Probe(&hosts, kProbeTimeoutMs);
+
+		pthread_mutex_lock(&state_mutex_);
+		bool session_connected = session_state_ == ZOO_CONNECTED_STATE;
+		pthread_mutex_unlock(&state_mutex_);
+
+		pthread_mutex_lock(&probe_mutex_);
+		probe_hosts_.swap(hosts);
+		BalanceServers(session_connected);
+		pthread_mutex_unlock(&probe_mutex_);
+	}
+}
+
+void ZKClient::BalanceServers(bool session_connected) {
+	host_ = ZKLatencyProbe::JoinHosts(probe_hosts_, probe_chroot_); // 重建会话时按最新的延迟顺序连接
+	if (!session_connected || probe_hosts_[0].rtt_us < 0) {
+		probe_streak_ = 0;
+		return;
+	}
+#if ZOO_MAJOR_VERSION > 3 || ZOO_MINOR_VERSION >= 5
+	HandleGuard guard(&handle_lock_);
+
+	int current = -1;
+	struct sockaddr_storage addr;
+	socklen_t addr_len = sizeof(addr);
+	if (zookeeper_get_connected_host(zhandle_, (struct sockaddr*)&addr, &addr_len)) {
+		current = ZKLatencyProbe::FindHost(probe_hosts_, (struct sockaddr*)&addr);
+	}
+	int near_rtt_us = probe_hosts_[0].rtt_us * kProbeNearRatio + kProbeNearSlackUs;
+	if (current < 0 || (probe_hosts_[current].rtt_us >= 0 && probe_hosts_[current].rtt_us <= near_rtt_us)) {
+		probe_streak_ = 0;
+		return;
+	}
+	// 连续两次探测都发现更近的server才迁移，避免网络抖动导致来回切换
+	if (++probe_streak_ < 2) {
+		return;
+	}
+	probe_streak_ = 0;
+	// 当前server不在新列表里，zk client会断开并连接新列表里的server，会话不变
+	std::string near_hosts = ZKLatencyProbe::JoinHosts(probe_hosts_, "", near_rtt_us);
+	if (zoo_set_servers(zhandle_, near_hosts.c_str()) == ZOK) {
+		servers_restricted_ = true;
+	}
+#endif
+}
+
+void ZKClient::RestoreServers() {
+	pthread_mutex_lock(&probe_mutex_);
+	if (servers_restricted_) {
+#if ZOO_MAJOR_VERSION > 3 || ZOO_MINOR_VERSION >= 5
+		HandleGuard guard(&handle_lock_);
+		zoo_set_servers(zhandle_, ZKLatencyProbe::JoinHosts(probe_hosts_, "").c_str());
+#endif
+		servers_restricted_ = false;
+	}
+	pthread_mutex_unlock(&probe_mutex_);
+}
+
+int ZKClient::WaitSessionState() {
+	/*
+	 * 等待session初始化完成，两种可能返回值：
+	 * 1，连接成功，会话建立。
+	 * 2，会话过期，在初始化期间很难发生，场景：连接成功后io线程cpu卡住，导致zkserver一段时间没有收到心跳，会话超时了，
+	 * 然后cpu恢复运转，connected的watch事件开始处理更新了session_state然后cond_signal，然而init线程cpu卡住了，
+	 * 然后zkserver挂了，然后io线程重连了另外一个zkserver，然而session过期了，然后返回我们session_expire的，然后
+	 * session_expire的watch事件更新了session_state，然后init线程cpu正常了，然后看见了expire_session这个状态。
+	 * （天哪，真的有这种牛逼的巧合吗。。。只是比较严谨而已~）
+	 * 另外，带clientid恢复一个已经过期的会话时，zkserver会立即告知会话过期。
+	 */
+	pthread_mutex_lock(&state_mutex_);
+	while (session_state_ != ZOO_CONNECTED_STATE &&
+			session_state_ != ZOO_EXPIRED_SESSION_STATE) {
+		pthread_cond_wait(&state_cond_, &state_mutex_);
+	}
+	int session_state = session_state_;
+	pthread_mutex_unlock(&state_mutex_);
+	return session_state;
+}
+
+bool ZKClient::LoadSessionId(clientid_t* clientid) {
+	if (session_file_.empty()) {
+		return false;
+	}
+	FILE* fp = fopen(session_file_.c_str(), "r");
+	if (!fp) {
+		return false;
+	}
+	// 格式: client_id(16进制) passwd(16进制) 会话超时(毫秒) 保存时间(毫秒)
+	long long client_id = 0, save_ms = 0;
+	int timeout = 0;
+	char passwd_hex[sizeof(clientid->passwd) * 2 + 1] = {0};
+	int fields = fscanf(fp, "%llx %32s %d %lld", &client_id, passwd_hex, &timeout, &save_ms);
+	fclose(fp);
+	if (fields != 4 || strlen(passwd_hex) != sizeof(clientid->passwd) * 2) {
+		return false;
+	}
+	// 进程退出后，会话最多还能存活一个会话超时时间
+	if (GetCurrentMs() - save_ms >= timeout) {
+		return false;
+	}
+	clientid->client_id = client_id;
+	for (size_t i = 0; i < sizeof(clientid->passwd); ++i) {
+		unsigned int byte = 0;
+		sscanf(passwd_hex + i * 2, "%2x", &byte);
+		clientid->passwd[i] = (char)byte;
+	}
+	return true;
+}
+
+void ZKClient::SaveSessionId() {
+	if (session_file_.empty()) {
+		return;
+	}
+	clientid_t clientid_copy;
+	{
+		HandleGuard guard(&handle_lock_);
+		clientid_copy = *zoo_client_id(zhandle_);
+	}
+	const clientid_t* clientid = &clientid_copy;
+	char passwd_hex[sizeof(clientid->passwd) * 2 + 1] = {0};
+	for (size_t i = 0; i < sizeof(clientid->passwd); ++i) {
+		snprintf(passwd_hex + i * 2, 3, "%02x", (unsigned char)clientid->passwd[i]);
+	}
+	pthread_mutex_lock(&state_mutex_);
+	int timeout = session_timeout_;
+	pthread_mutex_unlock(&state_mutex_);
+
+	session_save_ms_ = GetCurrentMs();
+	// 先写临时文件再rename，保证进程随时挂掉都不会留下半个文件。
+	// 拿到session id和密码就能接管会话，文件只允许本用户读写；先删除旧的临时文件，O_CREAT不会修改已有文件的权限
+	std::string tmp_file = session_file_ + ".tmp";
+	unlink(tmp_file.c_str());
+	int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0) {
+		return;
+	}
+	FILE* fp = fdopen(fd, "w");
+	if (!fp) {
+		close(fd);
+		return;
+	}
+	fprintf(fp, "%llx %s %d %lld\n", (long long)clientid->client_id, passwd_hex, timeout, (long long)session_save_ms_);
+	if (fclose(fp) == 0) {
+		rename(tmp_file.c_str(), session_file_.c_str());
+	}
+}
+
 void* ZKClient::SessionCheckThreadMain(void* arg) {
 	ZKClient* zkclient = (ZKClient*)arg;
 	zkclient->CheckSessionState();
 	return NULL;
 }
 
+void* ZKClient::ProbeThreadMain(void* arg) {
+	ZKClient* zkclient = (ZKClient*)arg;
+	zkclient->ProbeServers();
+	return NULL;
+}
+
 int64_t ZKClient::GetCurrentMs() {
 	struct timeval tv;
 	gettimeofday(&tv, NULL);
@@ -12,9 +12,12 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string>
+#include <list>
 #include <map>
+#include <set>
 #include <vector>
 #include "zookeeper.h"
+#include "zklatency.h"
 
 /**
  *		对于注册了Watch的操作，严格根据下列返回码来区分watch是否失效。
@@ -26,6 +29,8 @@
  */
 
 class ZKClient;
+class ZKSnapshot;
+struct ZKSnapshotRecord;
 
 enum ZKErrorCode {
 	kZKSucceed= 0, // 操作成功，watch继续生效
@@ -33,7 +38,9 @@ enum ZKErrorCode {
 	kZKError, // 请求失败, watch失效
 	kZKDeleted, // 节点删除，watch失效
 	kZKExisted, // 节点已存在，Create失败
-	kZKNotEmpty // 节点有子节点，Delete失败
+	kZKNotEmpty, // 节点有子节点，Delete失败
+	kZKStale, // 数据来自本地快照（会话尚未建立），watch继续生效，会话建立后如有变化再以kZKSucceed通知
+	kZKBadVersion // 节点版本与期望不符，带版本的Set失败
 };
 
 // 节点类型引用zookeeper原生定义
@@ -43,6 +50,7 @@ enum ZKErrorCode {
 //};
 
 typedef void (*SessionExpiredHandler)(void* context);
+typedef void (*SessionReplacedHandler)(void* context);
 typedef void (*GetNodeHandler)(ZKErrorCode errcode, const std::string& path, const char* value, int value_len, void* context);
 typedef void (*GetChildrenHandler)(ZKErrorCode errcode, const std::string& path, int count, char** data, void* context);
 typedef void (*ExistHandler)(ZKErrorCode errcode, const std::string& path, const struct Stat* stat, void* context);
@@ -50,13 +58,47 @@ typedef void (*CreateHandler)(ZKErrorCode errcode, const std::string& path, cons
 typedef void (*SetHandler)(ZKErrorCode errcode, const std::string& path, const struct Stat* stat, void* context);
 typedef void (*DeleteHandler)(ZKErrorCode errcode, const std::string& path, void* context);
 
+enum ZKOperationType {
+	kZKOpCreate = 0,
+	kZKOpDelete,
+	kZKOpSet,
+	kZKOpCheck // 只检查版本，不修改
+};
+
+// Multi中的一个操作
+struct ZKOperation {
+	ZKOperation(ZKOperationType type, const std::string& path, const std::string& value = "", int flags = 0,
+			int version = -1);
+
+	ZKOperationType type;
+	std::string path;
+	std::string value; // create/set的数据
+	int flags; // create的节点类型
+	int version; // delete/set/check期望的版本，-1表示不检查
+
+	// 执行结果
+	ZKErrorCode errcode;
+	std::string created_path; // create成功时节点的实际路径，顺序节点带有序号
+};
+
 struct ZKWatchContext {
 	ZKWatchContext(const std::string& path, void* context, ZKClient* zkclient, bool watch);
 
-	bool watch;
+	bool watch; // 对于订阅者，置为false表示已经取消订阅
 	void* context;
 	std::string path;
 	ZKClient* zkclient;
+
+	// 订阅者的变化通知策略，见ZKClient::SetWatchPolicy
+	int min_interval_ms;
+	int delay_ms;
+	int64_t notify_ms; // 上次通知的时间
+	int64_t change_ms; // 第一次未通知的变化的时间，0表示没有
+	int64_t due_ms; // 计划通知的时间，0表示没有
+
+	// 上次通知给订阅者的版本（节点不存在时为全0），版本没变的变化通知直接跳过
+	bool notify_versioned;
+	struct Stat notify_stat;
 	union {
 		GetNodeHandler getnode_handler;
 		GetChildrenHandler getchildren_handler;
@@ -67,15 +109,103 @@ struct ZKWatchContext {
 	};
 };
 
+// 可被多个订阅者共享的watch类型
+enum ZKWatchType {
+	kZKWatchNode = 0, // GetNode
+	kZKWatchChildren, // GetChildren
+	kZKWatchExist // Exist
+};
+
+/**
+ *		同一个(path, 类型)在zk上只注册一个watch，所有本地订阅者共享。
+ *
+ *		watch触发后只向zk拉取一次数据，然后分发给所有订阅者；新订阅者如果赶上正在进行中的拉取，
+ *		直接搭车等待结果，否则发起一次带watch的拉取（zk client对同一watcher+context去重，不会重复回调）。
+ *		最后一个订阅者退出后，zk上的watch在下次触发时自然失效，不再重新注册。
+ */
+struct ZKWatchEntry {
+	ZKWatchEntry(ZKWatchType type, const std::string& path, ZKClient* zkclient);
+
+	ZKWatchType type;
+	std::string path;
+	ZKClient* zkclient;
+	bool armed; // zk上的watch仍然生效，将来可能触发
+	bool dispatching; // 正在回调订阅者，此时取消订阅只做标记，回调结束后再释放
+	int inflight; // 尚未回调的请求数
+	int rearming; // 尚未回调的只注册watch的请求数
+	std::list<ZKWatchContext*> subscribers; // 已收到过数据，等待变化通知
+	std::list<ZKWatchContext*> pending; // 等待首次数据
+	std::list<ZKWatchContext*> canceled; // 回调期间取消的订阅者
+
+	// 最近一次拉取到的数据（只缓存GetNode/GetChildren），用于本地快照
+	bool cached;
+	std::string value;
+	std::vector<std::string> children;
+	struct Stat stat;
+	const ZKSnapshotRecord* stale; // 会话建立前从快照读到的数据，拿到实时数据后清空
+};
+
 class ZKClient {
 public:
 	static ZKClient& GetInstance();
 
 	~ZKClient();
 
+	/*
+	 * 开启会话持久化，需在Init之前调用。
+	 *
+	 * 会话建立后将session id和密码写入session_file并定期刷新，进程重启后如果距离上次刷新未超过会话超时时间，
+	 * Init会尝试恢复原会话，这样快速重启不会导致临时节点被删除重建，也不会触发其他节点的watch。
+	 * 注意：恢复会话后，原会话创建的临时节点依然存在，重新创建前需要先检查；原进程注册的watch不会恢复，需要重新注册。
+	 */
+	void SetSessionFile(const std::string& session_file);
+
+	/*
+	 * 开启watch数据的本地快照，需在Init之前调用。
+	 *
+	 * 所有被watch的节点数据和子节点列表在变化后，最多每interval_ms写一次快照文件（带校验和，可直接mmap）。
+	 * 启动时快照加载成功，Init不再阻塞等待会话建立，而是立即返回：
+	 *	1，带watch的GetNode/GetChildren如果在快照中找到数据，在调用线程里立即以kZKStale回调一次。
+	 *	2，会话建立后拉到实时数据，与快照的版本(czxid/mzxid/pzxid)比较，有变化才以kZKSucceed再回调。
+	 *	3，会话建立之前不做会话超时检测（还没有会话可以过期）。
+	 */
+	void SetSnapshotFile(const std::string& snapshot_file, int interval_ms = 1000);
+
+	/*
+	 * 开启按延迟选择zk server，需在Init之前调用。
+	 *
+	 * Init时测量到每个server的TCP握手耗时，按耗时从小到大排列host列表，并按此顺序连接（默认是随机选择），
+	 * 重建会话时同样按这个顺序连接。
+	 * zookeeper 3.5及以上版本：之后由单独的线程每interval_ms重新探测一次（不阻塞会话检测），如果连续两次发现
+	 * 当前连接的server比最近的server慢得多，就通过zoo_set_servers只保留近的server，由zk client平滑迁移连接，
+	 * 会话和watch都不受影响；迁移后如果连接断开超过会话超时时间的1/3，恢复完整的server列表。
+	 * zookeeper 3.4没有zoo_set_servers，只在Init时探测一次，不启动探测线程，interval_ms不起作用。
+	 */
+	void SetLatencyProbe(int interval_ms = 60000);
+
+	/*
+	 * 开启会话重建，需在Init之前调用。
+	 *
+	 * 会话过期后不再回调SessionExpiredHandler终结程序，而是在原地重建会话：
+	 *	1，关闭过期的zhandle，建立新会话。
+	 *	2，新会话建立后，重新创建本进程通过Create创建的非顺序临时节点（Delete删除的不再重建）。
+	 *	3，所有仍有订阅者的watch重新拉取当前数据并注册watch，订阅者以kZKSucceed收到最新数据，期间订阅不会失效。
+	 *	4，最后回调一次handler，通知会话已被替换。
+	 * 注意：顺序临时节点不会重建（重建后名字会变），需要用户在handler里自行处理，例如重新参与选主。
+	 * 重建时节点已存在且属于本会话视为成功；属于其他会话（例如另一个进程用了同一个路径）则不再重建，
+	 * 记为冲突，通过TakeConflictedEphemeralNodes取走。
+	 */
+	void SetSessionRebuild(SessionReplacedHandler handler, void* context = NULL);
+
+	// 取走会话重建时发现被其他会话占用的临时节点路径，可以在SessionReplacedHandler里调用
+	void TakeConflictedEphemeralNodes(std::vector<std::string>* paths);
+
 	bool Init(const std::string& host, int timeout, SessionExpiredHandler expired_handler = NULL, void* context = NULL,
 			 bool debug = false, const std::string& zklog = "");
 
+	// 当前会话的id，与临时节点Stat里的ephemeralOwner比较可以判断节点是否属于本会话，会话建立之前为0
+	int64_t GetSessionId();
+
 	/* async api */
 	bool GetNode(const std::string& path, GetNodeHandler handler, void* context, bool watch = false);
 
@@ -85,7 +215,8 @@ public:
 
 	bool Create(const std::string& path, const std::string& value, int flags, CreateHandler handler, void* context);
 
-	bool Set(const std::string& path, const std::string& value, SetHandler handler, void* context);
+	// version为-1时无条件覆盖，否则只有节点当前版本等于version才写入(CAS)，不符回调kZKBadVersion
+	bool Set(const std::string& path, const std::string& value, SetHandler handler, void* context, int version = -1);
 
 	bool Delete(const std::string& path, DeleteHandler handler, void* context);
 
@@ -93,6 +224,9 @@ public:
 	ZKErrorCode GetNode(const std::string& path, char* buffer, int* buffer_len, GetNodeHandler handler = NULL,
 			void* context = NULL, bool watch = false);
 
+	// 不带watch，返回完整数据以及节点的Stat（其中version用于带版本的Set）
+	ZKErrorCode GetNode(const std::string& path, std::string* value, struct Stat* stat = NULL);
+
 	ZKErrorCode GetChildren(const std::string& path, std::vector<std::string>* value, GetChildrenHandler handler = NULL,
 			void* context = NULL, bool watch = false);
 
@@ -101,10 +235,46 @@ public:
 
 	ZKErrorCode Create(const std::string& path, const std::string& value, int flags, char* path_buffer = NULL, int path_buffer_len = 0);
 
-	ZKErrorCode Set(const std::string& path, const std::string& value);
+	ZKErrorCode Set(const std::string& path, const std::string& value, int version = -1, struct Stat* stat = NULL);
 
 	ZKErrorCode Delete(const std::string& path);
 
+	/*
+	 * 原子地执行一批操作(zoo_multi)：全部成功返回kZKSucceed；否则全部不生效，
+	 * 返回导致失败的那个操作的错误码，该操作的errcode同样是这个错误码，其余操作的errcode为kZKError。
+	 */
+	ZKErrorCode Multi(std::vector<ZKOperation>* ops);
+
+	/*
+	 * 读取被watch的节点的本地缓存，不访问zk。
+	 * 返回kZKSucceed为最近一次拉取到的数据，kZKStale为快照里的数据，kZKNotExist表示没有缓存。
+	 */
+	ZKErrorCode GetCachedNode(const std::string& path, std::string* value, struct Stat* stat = NULL);
+
+	ZKErrorCode GetCachedChildren(const std::string& path, std::vector<std::string>* children, struct Stat* stat = NULL);
+
+	/* 取消watch订阅，按(path, handler, context)匹配，其他订阅者共享的watch不受影响 */
+	bool Unwatch(const std::string& path, GetNodeHandler handler, void* context);
+
+	bool Unwatch(const std::string& path, GetChildrenHandler handler, void* context);
+
+	bool Unwatch(const std::string& path, ExistHandler handler, void* context);
+
+	/*
+	 * 设置watch订阅者的变化通知策略，按(path, handler, context)匹配，对之后的变化通知生效，默认立即通知。
+	 *
+	 * min_interval_ms：节流，两次通知至少间隔min_interval_ms，期间的变化合并为一次，到时通知最新数据。
+	 * delay_ms：防抖，变化后等待delay_ms再通知，期间再有变化则重新计时；持续变化时最多推迟到第一次变化后10倍delay_ms。
+	 * 节点删除、watch失效等通知不受影响，总是立即回调。
+	 * 等待期间GetNode/Exist的watch立即用exists重新注册（不拉取数据），不会漏掉变化，到时只拉取一次最新数据；
+	 * GetChildren没有不拉取数据的注册方式，等待期间不重新注册，到时拉到的总是最新列表，因此防抖从第一次变化开始计时，不会重新计时。
+	 */
+	bool SetWatchPolicy(const std::string& path, GetNodeHandler handler, void* context, int min_interval_ms, int delay_ms = 0);
+
+	bool SetWatchPolicy(const std::string& path, GetChildrenHandler handler, void* context, int min_interval_ms, int delay_ms = 0);
+
+	bool SetWatchPolicy(const std::string& path, ExistHandler handler, void* context, int min_interval_ms, int delay_ms = 0);
+
 private:
 	static void NewInstance();
 	static ZKClient& GetClient();
@@ -112,19 +282,71 @@ private:
 	static void DefaultSessionExpiredHandler(void* context);
 	static void SessionWatcher(zhandle_t* zh, int type, int state, const char* path, void* watcher_ctx);
 	static void* SessionCheckThreadMain(void* arg);
+	static void* ProbeThreadMain(void* arg);
 
 	// GetNode的zk回调处理
 	static void GetNodeDataCompletion(int rc, const char* value, int value_len,
 	        const struct Stat* stat, const void* data);
-	static void GetNodeWatcher(zhandle_t* zh, int type, int state, const char* path,void* watcher_ctx);
 
 	// GetChildren的zk回调处理
 	static void GetChildrenStringCompletion(int rc, const struct String_vector* strings, const void* data);
-	static void GetChildrenWatcher(zhandle_t* zh, int type, int state, const char* path,void* watcher_ctx);
 
 	// Exist的zk回调处理
 	static void ExistCompletion(int rc, const struct Stat* stat, const void* data);
-	static void ExistWatcher(zhandle_t* zh, int type, int state, const char* path, void* watcher_ctx);
+
+	// 共享watch的zk回调处理
+	struct WatchFetch;
+	struct WatchResult;
+	static void WatchEntryWatcher(zhandle_t* zh, int type, int state, const char* path, void* watcher_ctx);
+	static void WatchNodeCompletion(int rc, const char* value, int value_len,
+			const struct Stat* stat, const void* data);
+	static void WatchChildrenCompletion(int rc, const struct String_vector* strings, const struct Stat* stat,
+			const void* data);
+	static void WatchExistCompletion(int rc, const struct Stat* stat, const void* data);
+	static void WatchRearmCompletion(int rc, const struct Stat* stat, const void* data);
+	static void WatchCheckCompletion(int rc, const struct Stat* stat, const void* data);
+	static void InvokeHandler(const ZKWatchEntry* entry, const ZKWatchContext* watch_ctx, const WatchResult& result);
+
+	bool Subscribe(ZKWatchType type, ZKWatchContext* watch_ctx);
+	ZKErrorCode SubscribeSync(ZKWatchType type, ZKWatchContext* watch_ctx, char* buffer, int* buffer_len,
+			std::vector<std::string>* children, struct Stat* stat);
+	bool Unsubscribe(ZKWatchType type, const ZKWatchContext& key);
+	ZKWatchEntry* GetWatchEntry(ZKWatchType type, const std::string& path);
+	void ReleaseWatchEntry(ZKWatchEntry* entry);
+	int FetchWatchEntry(zhandle_t* zhandle, ZKWatchEntry* entry, bool refresh);
+	int RearmWatchEntry(zhandle_t* zhandle, ZKWatchEntry* entry);
+	void OnWatchRearmed(ZKWatchEntry* entry, int rc);
+	int CheckWatchEntry(zhandle_t* zhandle, ZKWatchEntry* entry);
+	void OnWatchChecked(zhandle_t* zhandle, ZKWatchEntry* entry, int rc, const struct Stat* stat);
+	int64_t ScheduleNotify(ZKWatchEntry* entry, int64_t now_ms, bool immediate);
+	void DispatchDelayedWatches();
+	bool SetPolicy(ZKWatchType type, const ZKWatchContext& key, int min_interval_ms, int delay_ms);
+	void OnWatchEvent(zhandle_t* zhandle, ZKWatchType watch_type, const std::string& path, int type);
+	void OnWatchFetched(ZKWatchEntry* entry, bool refresh, bool session_lost, const WatchResult& result);
+	void UpdateWatchCache(ZKWatchEntry* entry, const WatchResult& result);
+	ZKErrorCode GetCachedEntry(ZKWatchType type, const std::string& path, std::string* value,
+			std::vector<std::string>* children, struct Stat* stat);
+
+	// 本地快照
+	bool LoadSnapshot();
+	void SaveSnapshot();
+
+	// 用新会话替换当前zhandle_
+	bool RenewSession();
+
+	// 按延迟选择zk server，BalanceServers需持有probe_mutex_
+	void ProbeServers();
+	void BalanceServers(bool session_connected);
+	void RestoreServers();
+
+	// 会话重建
+	struct EphemeralCreate;
+	static void EphemeralCreateCompletion(int rc, const char* value, const void* data);
+	bool SessionRenewing();
+	void RearmWatches();
+	bool RecreateEphemeralNodes();
+	void AddEphemeralNode(const std::string& path, const std::string& value);
+	void RemoveEphemeralNode(const std::string& path);
 
 	// Create的zk回调处理
 	static void CreateCompletion(int rc, const char* value, const void* data);
@@ -137,6 +359,11 @@ private:
 
 	void UpdateSessionState(zhandle_t* zhandle, int state);
 	void CheckSessionState();
+	int WaitSessionState();
+
+	// 会话持久化
+	bool LoadSessionId(clientid_t* clientid);
+	void SaveSessionId();
 
 	int64_t GetCurrentMs();
 
@@ -158,9 +385,54 @@ private:
 	pthread_mutex_t state_mutex_;
 	pthread_cond_t state_cond_;
 
+	// 会话持久化文件，以及上次写入的时间
+	std::string session_file_;
+	int64_t session_save_ms_;
+	bool session_resumed_; // 本次会话是否来自持久化文件的恢复
+	bool session_established_; // 会话是否已经建立过
+	bool session_renewed_; // zhandle_已被替换，新会话建立后需要重新注册watch
+
+	// zhandle_可能被替换（例如放弃恢复的会话），使用时需持有读锁
+	std::string host_;
+	zhandle_t* retired_handle_; // 正在关闭的旧zhandle，忽略其会话事件
+	pthread_rwlock_t handle_lock_;
+
+	// 本地快照
+	std::string snapshot_file_;
+	int snapshot_interval_ms_;
+	int64_t snapshot_save_ms_;
+	bool snapshot_dirty_;
+	ZKSnapshot* snapshot_;
+
+	// 按延迟选择zk server，探测在单独的线程里进行，host_和以下字段由probe_mutex_保护
+	int probe_interval_ms_; // 0表示不开启
+	int64_t probe_ms_; // 只在Init和探测线程里访问
+	std::vector<ZKHostLatency> probe_hosts_; // 最近一次探测结果，按延迟排序
+	std::string probe_chroot_;
+	int probe_streak_; // 连续发现更近server的次数
+	bool servers_restricted_; // 已经只保留近的server
+	pthread_mutex_t probe_mutex_;
+	bool probe_running_;
+	pthread_t probe_tid_;
+
+	// 会话重建，需要重建的临时节点为path到value的映射
+	bool session_rebuild_;
+	bool session_replaced_; // 会话因过期被替换，完成后通知用户
+	SessionReplacedHandler replaced_handler_;
+	void* replaced_context_;
+	std::map<std::string, std::string> ephemeral_nodes_;
+	std::vector<std::string> conflicted_nodes_; // 被其他会话占用，不再重建的临时节点
+	pthread_mutex_t ephemeral_mutex_;
+
 	// ZK会话状态检测线程（由于zk精确到毫秒，所以毫秒级间隔check）
 	bool session_check_running_;
 	pthread_t session_check_tid_;
+
+	// 共享watch注册表，key为(类型, path)，递归锁，允许在订阅者回调里再次调用ZKClient
+	typedef std::map<std::pair<int, std::string>, ZKWatchEntry*> WatchEntryMap;
+	WatchEntryMap watch_entries_;
+	std::set<ZKWatchEntry*> delayed_entries_; // 有订阅者等待延迟通知
+	pthread_mutex_t watch_mutex_;
 };
 
 
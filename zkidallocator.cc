@@ -0,0 +1,201 @@
+/*
+ * zkidallocator.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "zkclient.h"
+#include "zkidallocator.h"
+
+ZKIdAllocator::ZKIdAllocator(const std::string& path, int block_size)
+	: path_(path), block_size_(block_size > 0 ? block_size : 1), cursor_(0), next_ready_(false), prefetching_(false),
+	  prefetch_running_(false) {
+	for (int i = 0; i < 2; ++i) {
+		blocks_[i].gen = kInvalidGen;
+		blocks_[i].start = 0;
+	}
+	pthread_mutex_init(&mutex_, NULL);
+	pthread_cond_init(&prefetch_cond_, NULL);
+	pthread_cond_init(&ready_cond_, NULL);
+}
+
+ZKIdAllocator::~ZKIdAllocator() {
+	Stop();
+	pthread_cond_destroy(&ready_cond_);
+	pthread_cond_destroy(&prefetch_cond_);
+	pthread_mutex_destroy(&mutex_);
+}
+
+bool ZKIdAllocator::Init() {
+	if (prefetch_running_) {
+		return false;
+	}
+	int64_t start;
+	if (!CreateCounter() || !Lease(&start)) {
+		return false;
+	}
+	FillBlock(0, start);
+	cursor_ = 0;
+
+	prefetch_running_ = true;
+	if (pthread_create(&prefetch_tid_, NULL, PrefetchThreadMain, this)) {
+		prefetch_running_ = false;
+		return false;
+	}
+	return true;
+}
+
+bool ZKIdAllocator::Next(int64_t* id, int timeout_ms) {
+	bool has_deadline = false;
+	struct timespec deadline;
+
+	for (;;) {
+		uint64_t cursor = __sync_fetch_and_add(&cursor_, 1);
+		uint32_t gen = cursor >> 32;
+		uint32_t offset = (uint32_t)cursor;
+
+		if (offset < block_size_) { // 快速路径：只有一次原子加
+			const Block& block = blocks_[gen & 1];
+			if (block.gen == gen) {
+				__sync_synchronize();
+				int64_t start = block.start;
+				__sync_synchronize();
+				if (block.gen == gen) {
+					if (offset == block_size_ / 2) { // 当前号段用掉一半，预取下一个
+						RequestPrefetch();
+					}
+					*id = start + offset;
+					return true;
+				}
+			}
+			continue; // 取到的是已被替换的旧号段，重新分配
+		}
+
+		// 当前号段用完，切换到下一个号段，还没取到就等待预取线程
+		pthread_mutex_lock(&mutex_);
+		while ((uint32_t)(cursor_ >> 32) == gen && !next_ready_) {
+			prefetching_ = true;
+			pthread_cond_signal(&prefetch_cond_);
+			if (!has_deadline) {
+				struct timeval now;
+				gettimeofday(&now, NULL);
+				int64_t ns = (int64_t)now.tv_usec * 1000 + (int64_t)timeout_ms * 1000000;
+				deadline.tv_sec = now.tv_sec + ns / 1000000000;
+				deadline.tv_nsec = ns % 1000000000;
+				has_deadline = true;
+			}
+			if (pthread_cond_timedwait(&ready_cond_, &mutex_, &deadline) == ETIMEDOUT) {
+				pthread_mutex_unlock(&mutex_);
+				return false;
+			}
+		}
+		if ((uint32_t)(cursor_ >> 32) == gen) { // 其他线程还没有切换
+			next_ready_ = false;
+			__sync_synchronize();
+			__sync_lock_test_and_set(&cursor_, (uint64_t)(gen + 1) << 32);
+		}
+		pthread_mutex_unlock(&mutex_);
+	}
+	return false;
+}
+
+void ZKIdAllocator::Stop() {
+	if (prefetch_running_) {
+		pthread_mutex_lock(&mutex_);
+		prefetch_running_ = false;
+		pthread_cond_signal(&prefetch_cond_);
+		pthread_mutex_unlock(&mutex_);
+		pthread_join(prefetch_tid_, NULL);
+	}
+}
+
+bool ZKIdAllocator::CreateCounter() {
+	ZKErrorCode errcode = ZKClient::GetInstance().Create(path_, "0", 0);
+	return errcode == kZKSucceed || errcode == kZKExisted;
+}
+
+bool ZKIdAllocator::Lease(int64_t* start) {
+	ZKClient& zkclient = ZKClient::GetInstance();
+
+	for (;;) {
+		std::string value;
+		struct Stat stat;
+		if (zkclient.GetNode(path_, &value, &stat) != kZKSucceed) {
+			return false;
+		}
+		int64_t next;
+		if (sscanf(value.c_str(), "%lld", (long long*)&next) != 1 || next < 0) { // 计数器节点被人为改坏
+			return false;
+		}
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%lld", (long long)(next + block_size_));
+		ZKErrorCode errcode = zkclient.Set(path_, buffer, stat.version);
+		if (errcode == kZKSucceed) {
+			*start = next;
+			return true;
+		} else if (errcode != kZKBadVersion) {
+			return false;
+		}
+		// 其他进程抢先租用了号段，重新读取计数器
+	}
+	return false;
+}
+
+void ZKIdAllocator::FillBlock(uint32_t gen, int64_t start) {
+	Block& block = blocks_[gen & 1];
+	block.gen = kInvalidGen;
+	__sync_synchronize();
+	block.start = start;
+	__sync_synchronize();
+	block.gen = gen;
+}
+
+void ZKIdAllocator::RequestPrefetch() {
+	pthread_mutex_lock(&mutex_);
+	if (!next_ready_) {
+		prefetching_ = true;
+		pthread_cond_signal(&prefetch_cond_);
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+void* ZKIdAllocator::PrefetchThreadMain(void* arg) {
+	ZKIdAllocator* allocator = (ZKIdAllocator*)arg;
+	allocator->Prefetch();
+	return NULL;
+}
+
+void ZKIdAllocator::Prefetch() {
+	pthread_mutex_lock(&mutex_);
+	while (prefetch_running_) {
+		if (!prefetching_ || next_ready_) {
+			pthread_cond_wait(&prefetch_cond_, &mutex_);
+			continue;
+		}
+		pthread_mutex_unlock(&mutex_);
+		int64_t start;
+		bool leased = Lease(&start);
+		pthread_mutex_lock(&mutex_);
+
+		if (leased) {
+			// 下一个号段取到之前不会切换，所以当前gen不变
+			FillBlock((uint32_t)(cursor_ >> 32) + 1, start);
+			next_ready_ = true;
+			prefetching_ = false;
+			pthread_cond_broadcast(&ready_cond_);
+		} else { // zk暂时不可用，100毫秒后重试
+			struct timeval now;
+			gettimeofday(&now, NULL);
+			struct timespec retry;
+			int64_t ns = (int64_t)now.tv_usec * 1000 + 100000000;
+			retry.tv_sec = now.tv_sec + ns / 1000000000;
+			retry.tv_nsec = ns % 1000000000;
+			pthread_cond_timedwait(&prefetch_cond_, &mutex_, &retry);
+		}
+	}
+	pthread_mutex_unlock(&mutex_);
+}
@@ -0,0 +1,85 @@
+/*
+ * zkidallocator.h
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#ifndef ZK_ZKIDALLOCATOR_H_
+#define ZK_ZKIDALLOCATOR_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+
+/**
+ *		基于计数器节点的分布式ID分配器，按号段租用ID。
+ *
+ *		计数器节点的value是十进制的下一个未分配ID，每次用带版本的Set(CAS)把它加上block_size，
+ *		就租到了一个号段[value, value + block_size)，版本冲突(kZKBadVersion)时重新读取再试。
+ *		号段内的ID在本地用一次原子加分配，不访问zk；当前号段用掉一半时，后台线程预取下一个号段，
+ *		所以正常情况下Next不会等待zk，平均每block_size个ID才有一次zk往返。
+ *
+ *		ID全局唯一、同一线程内递增，但不连续：进程退出时未用完的号段会被丢弃。
+ *		线程安全，Next可以被多个线程并发调用。
+ */
+class ZKIdAllocator {
+public:
+	// path为计数器节点，父节点需已存在；block_size为每次租用的ID个数
+	explicit ZKIdAllocator(const std::string& path, int block_size = 1000);
+
+	virtual ~ZKIdAllocator();
+
+	// 计数器节点不存在时以0创建，同步租用第一个号段，并启动预取线程。需在ZKClient::Init之后调用
+	bool Init();
+
+	/*
+	 * 分配一个ID。当前号段用完且下一个号段还没取到时，最多等待timeout_ms，超时返回false。
+	 */
+	bool Next(int64_t* id, int timeout_ms = 1000);
+
+protected:
+	// 计数器节点不存在时以0创建
+	virtual bool CreateCounter();
+	// 用CAS从计数器节点租用一个号段[start, start + block_size)，在Init和预取线程中调用
+	virtual bool Lease(int64_t* start);
+	// 终止预取线程。重写了Lease的派生类需在析构函数开头调用，避免预取线程在派生部分析构后还调用Lease
+	void Stop();
+
+private:
+	// 号段，大小都是block_size_。gen为号段的代数，写入期间置为kInvalidGen，读者读取前后比较gen判断号段是否被替换
+	struct Block {
+		volatile uint32_t gen;
+		volatile int64_t start;
+	};
+
+	static const uint32_t kInvalidGen = 0xffffffff;
+
+	static void* PrefetchThreadMain(void* arg);
+
+	void Prefetch();
+	void RequestPrefetch();
+	void FillBlock(uint32_t gen, int64_t start);
+
+	ZKIdAllocator(const ZKIdAllocator&);
+	ZKIdAllocator& operator=(const ZKIdAllocator&);
+
+	std::string path_;
+	uint32_t block_size_;
+
+	// 高32位为当前号段的gen，低32位为号段内下一个偏移，Next对其原子加1
+	volatile uint64_t cursor_;
+	Block blocks_[2]; // 当前号段和下一个号段，按gen奇偶轮换
+
+	// 以下字段由mutex_保护
+	bool next_ready_; // 下一个号段已经取到
+	bool prefetching_; // 需要预取下一个号段
+	pthread_mutex_t mutex_;
+	pthread_cond_t prefetch_cond_;
+	pthread_cond_t ready_cond_;
+
+	bool prefetch_running_;
+	pthread_t prefetch_tid_;
+};
+
+#endif /* ZK_ZKIDALLOCATOR_H_ */
@@ -0,0 +1,198 @@
+/*
+ * zklatency.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include "zklatency.h"
+
+namespace {
+	int64_t GetCurrentUs() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (int64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	}
+
+	// 可达的排前面，再按耗时排序
+	bool LatencyLess(const ZKHostLatency& lhs, const ZKHostLatency& rhs) {
+		if ((lhs.rtt_us < 0) != (rhs.rtt_us < 0)) {
+			return rhs.rtt_us < 0;
+		}
+		return lhs.rtt_us < rhs.rtt_us;
+	}
+
+	bool SameAddress(const struct sockaddr* lhs, const struct sockaddr* rhs) {
+		if (lhs->sa_family != rhs->sa_family) {
+			return false;
+		}
+		if (lhs->sa_family == AF_INET) {
+			const struct sockaddr_in* lhs4 = (const struct sockaddr_in*)lhs;
+			const struct sockaddr_in* rhs4 = (const struct sockaddr_in*)rhs;
+			return lhs4->sin_port == rhs4->sin_port && lhs4->sin_addr.s_addr == rhs4->sin_addr.s_addr;
+		} else if (lhs->sa_family == AF_INET6) {
+			const struct sockaddr_in6* lhs6 = (const struct sockaddr_in6*)lhs;
+			const struct sockaddr_in6* rhs6 = (const struct sockaddr_in6*)rhs;
+			return lhs6->sin6_port == rhs6->sin6_port &&
+					memcmp(&lhs6->sin6_addr, &rhs6->sin6_addr, sizeof(lhs6->sin6_addr)) == 0;
+		}
+		return false;
+	}
+}
+
+bool ZKLatencyProbe::ParseHosts(const std::string& hosts, std::vector<ZKHostLatency>* result, std::string* chroot) {
+	std::string::size_type slash = hosts.find('/');
+	std::string host_list = hosts.substr(0, slash);
+	chroot->assign(slash == std::string::npos ? "" : hosts.substr(slash));
+
+	result->clear();
+	std::string::size_type begin = 0;
+	while (begin <= host_list.size()) {
+		std::string::size_type end = host_list.find(',', begin);
+		if (end == std::string::npos) {
+			end = host_list.size();
+		}
+		std::string host = host_list.substr(begin, end - begin);
+		begin = end + 1;
+
+		std::string::size_type colon = host.rfind(':');
+		if (host.empty() || colon == std::string::npos) {
+			continue;
+		}
+		std::string name = host.substr(0, colon);
+		std::string port = host.substr(colon + 1);
+		if (name.size() > 2 && name[0] == '[' && name[name.size() - 1] == ']') { // [ipv6]:port
+			name = name.substr(1, name.size() - 2);
+		}
+
+		ZKHostLatency latency;
+		latency.host = host;
+		latency.rtt_us = -1;
+		struct addrinfo hints;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		struct addrinfo* addrs = NULL;
+		if (getaddrinfo(name.c_str(), port.c_str(), &hints, &addrs) == 0) { // 解析失败的server保留，按不可达处理
+			for (struct addrinfo* addr = addrs; addr; addr = addr->ai_next) {
+				struct sockaddr_storage storage;
+				memset(&storage, 0, sizeof(storage));
+				memcpy(&storage, addr->ai_addr, addr->ai_addrlen);
+				latency.addrs.push_back(storage);
+			}
+			freeaddrinfo(addrs);
+		}
+		result->push_back(latency);
+	}
+	return !result->empty();
+}
+
+void ZKLatencyProbe::Probe(std::vector<ZKHostLatency>* hosts, int timeout_ms) {
+	std::vector<struct pollfd> fds;
+	std::vector<int> owners; // fds[i]属于哪个server
+	std::vector<int64_t> connect_us; // fds[i]发起连接的时间
+	int64_t start_us = GetCurrentUs();
+
+	for (size_t i = 0; i < hosts->size(); ++i) {
+		ZKHostLatency& latency = (*hosts)[i];
+		latency.rtt_us = -1;
+		for (size_t j = 0; j < latency.addrs.size(); ++j) {
+			const struct sockaddr* addr = (const struct sockaddr*)&latency.addrs[j];
+			socklen_t addr_len = addr->sa_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+			int fd = socket(addr->sa_family, SOCK_STREAM, 0);
+			if (fd < 0) {
+				continue;
+			}
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+			int64_t begin_us = GetCurrentUs();
+			int rc = connect(fd, addr, addr_len);
+			if (rc == 0) { // 本机地址可能立即连上
+				int rtt_us = GetCurrentUs() - begin_us;
+				if (latency.rtt_us < 0 || rtt_us < latency.rtt_us) {
+					latency.rtt_us = rtt_us;
+				}
+				close(fd);
+				continue;
+			} else if (errno != EINPROGRESS) {
+				close(fd);
+				continue;
+			}
+			struct pollfd pfd;
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			pfd.revents = 0;
+			fds.push_back(pfd);
+			owners.push_back(i);
+			connect_us.push_back(begin_us);
+		}
+	}
+
+	// 所有连接并发进行，每完成一个记录一次耗时
+	size_t remain = fds.size();
+	while (remain) {
+		int wait_ms = timeout_ms - (GetCurrentUs() - start_us) / 1000;
+		if (wait_ms <= 0 || poll(&fds[0], fds.size(), wait_ms) <= 0) {
+			break;
+		}
+		int64_t now_us = GetCurrentUs();
+		for (size_t i = 0; i < fds.size(); ++i) {
+			if (fds[i].fd < 0 || !fds[i].revents) {
+				continue;
+			}
+			int error = 0;
+			socklen_t error_len = sizeof(error);
+			if (getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &error_len) == 0 && error == 0) {
+				ZKHostLatency& latency = (*hosts)[owners[i]];
+				int rtt_us = now_us - connect_us[i];
+				if (latency.rtt_us < 0 || rtt_us < latency.rtt_us) {
+					latency.rtt_us = rtt_us;
+				}
+			}
+			close(fds[i].fd);
+			fds[i].fd = -1; // poll忽略负数fd
+			--remain;
+		}
+	}
+	for (size_t i = 0; i < fds.size(); ++i) {
+		if (fds[i].fd >= 0) {
+			close(fds[i].fd);
+		}
+	}
+	std::stable_sort(hosts->begin(), hosts->end(), LatencyLess);
+}
+
+std::string ZKLatencyProbe::JoinHosts(const std::vector<ZKHostLatency>& hosts, const std::string& chroot,
+		int max_rtt_us) {
+	std::string result;
+	for (size_t i = 0; i < hosts.size(); ++i) {
+		if (max_rtt_us >= 0 && (hosts[i].rtt_us < 0 || hosts[i].rtt_us > max_rtt_us)) {
+			continue;
+		}
+		if (!result.empty()) {
+			result.append(",");
+		}
+		result.append(hosts[i].host);
+	}
+	return result + chroot;
+}
+
+int ZKLatencyProbe::FindHost(const std::vector<ZKHostLatency>& hosts, const struct sockaddr* addr) {
+	for (size_t i = 0; i < hosts.size(); ++i) {
+		for (size_t j = 0; j < hosts[i].addrs.size(); ++j) {
+			if (SameAddress((const struct sockaddr*)&hosts[i].addrs[j], addr)) {
+				return i;
+			}
+		}
+	}
+	return -1;
+}
@@ -0,0 +1,44 @@
+/*
+ * zklatency.h
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#ifndef ZK_ZKLATENCY_H_
+#define ZK_ZKLATENCY_H_
+
+#include <sys/socket.h>
+#include <string>
+#include <vector>
+
+// 一个zk server的探测结果
+struct ZKHostLatency {
+	std::string host; // 用户配置的host:port
+	std::vector<struct sockaddr_storage> addrs; // host解析出的所有地址
+	int rtt_us; // 最快地址的TCP握手耗时（微秒），-1表示不可达
+};
+
+/**
+ *		测量本机到zk server的TCP握手耗时，用于优先连接最近的server。
+ *
+ *		只建立TCP连接然后立即关闭，不发送任何zk协议数据，对所有server的所有地址并发探测，
+ *		一次探测最多阻塞timeout_ms。
+ */
+class ZKLatencyProbe {
+public:
+	// 解析zookeeper_init格式的"host1:port1,host2:port2/chroot"，chroot为可选的路径后缀
+	static bool ParseHosts(const std::string& hosts, std::vector<ZKHostLatency>* result, std::string* chroot);
+
+	// 探测所有server，并按耗时从小到大稳定排序，不可达的排在最后
+	static void Probe(std::vector<ZKHostLatency>* hosts, int timeout_ms);
+
+	// 按当前顺序拼回host列表，max_rtt_us >= 0时只保留耗时不超过它的server
+	static std::string JoinHosts(const std::vector<ZKHostLatency>& hosts, const std::string& chroot,
+			int max_rtt_us = -1);
+
+	// 查找地址属于哪个server，找不到返回-1
+	static int FindHost(const std::vector<ZKHostLatency>& hosts, const struct sockaddr* addr);
+};
+
+#endif /* ZK_ZKLATENCY_H_ */
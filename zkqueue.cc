@@ -0,0 +1,306 @@
+/*
+ * zkqueue.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#include <errno.h>
+#include <sys/time.h>
+#include <algorithm>
+#include <map>
+#include "zkqueue.h"
+
+namespace {
+	int64_t GetCurrentMs() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	}
+}
+
+ZKQueue::ZKQueue(const std::string& path)
+	: path_(path), items_path_(path + "/items"), waiters_path_(path + "/waiters"), fetching_(0), wakeup_count_(0) {
+	pthread_mutex_init(&pop_mutex_, NULL);
+	pthread_mutex_init(&mutex_, NULL);
+	pthread_cond_init(&cond_, NULL);
+}
+
+ZKQueue::~ZKQueue() {
+	pthread_cond_destroy(&cond_);
+	pthread_mutex_destroy(&mutex_);
+	pthread_mutex_destroy(&pop_mutex_);
+}
+
+bool ZKQueue::Init() {
+	ZKClient& zkclient = ZKClient::GetInstance();
+	const std::string* paths[] = { &path_, &items_path_, &waiters_path_ };
+	for (size_t i = 0; i < sizeof(paths) / sizeof(paths[0]); ++i) {
+		ZKErrorCode errcode = zkclient.Create(*paths[i], "", 0);
+		if (errcode != kZKSucceed && errcode != kZKExisted) {
+			return false;
+		}
+	}
+	return true;
+}
+
+ZKErrorCode ZKQueue::Push(const std::string& item) {
+	return Push(std::vector<std::string>(1, item));
+}
+
+ZKErrorCode ZKQueue::Push(const std::vector<std::string>& items, int* pushed) {
+	ZKClient& zkclient = ZKClient::GetInstance();
+	std::string prefix = items_path_ + "/item-";
+	if (pushed) {
+		*pushed = 0;
+	}
+
+	size_t begin = 0;
+	while (begin < items.size()) {
+		std::vector<ZKOperation> ops;
+		int bytes = 0;
+		for (size_t i = begin; i < items.size() && (int)ops.size() < kMaxBatchOps; ++i) {
+			if (!ops.empty() && bytes + (int)items[i].size() > kMaxBatchBytes) {
+				break;
+			}
+			bytes += items[i].size() + prefix.size();
+			ops.push_back(ZKOperation(kZKOpCreate, prefix, items[i], ZOO_SEQUENCE));
+		}
+		ZKErrorCode errcode = zkclient.Multi(&ops);
+		if (errcode != kZKSucceed) {
+			return errcode;
+		}
+		begin += ops.size();
+		if (pushed) {
+			*pushed += ops.size();
+		}
+	}
+	return kZKSucceed;
+}
+
+ZKErrorCode ZKQueue::Pop(std::vector<std::string>* items, int max_items, int timeout_ms) {
+	if (max_items <= 0) {
+		return kZKError;
+	}
+	int64_t deadline_ms = GetCurrentMs() + timeout_ms;
+
+	pthread_mutex_lock(&pop_mutex_);
+	ZKErrorCode errcode;
+	for (;;) {
+		int claimed = Claim(items, max_items);
+		if (claimed > 0) {
+			errcode = kZKSucceed;
+			break;
+		} else if (claimed < 0) {
+			errcode = kZKError;
+			break;
+		}
+		// 队列为空，或者元素都被其他消费者取走了，排队等待
+		errcode = Wait(deadline_ms);
+		if (errcode != kZKSucceed) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pop_mutex_);
+	return errcode;
+}
+
+int ZKQueue::Claim(std::vector<std::string>* items, int max_items) {
+	ZKClient& zkclient = ZKClient::GetInstance();
+	// multi因为有元素被其他消费者抢先删除而失败时，同一批里的其他元素多半也已被取走，
+	// 逐个剔除每轮只能发现一个，所以每轮重新拉取元素列表并重建整批。元素数据不会被修改，已经取到的数据直接沿用
+	std::map<std::string, std::string> fetched;
+	for (;;) {
+		std::vector<std::string> children;
+		if (zkclient.GetChildren(items_path_, &children) != kZKSucceed) {
+			return -1;
+		}
+		std::vector<char*> names(children.size());
+		for (size_t i = 0; i < children.size(); ++i) {
+			names[i] = (char*)children[i].c_str();
+		}
+		index_.Update(names.size(), names.empty() ? NULL : &names[0]);
+		if (!index_.Size()) {
+			return 0;
+		}
+
+		// 序号最小的max_items个元素，GetNode全部发出后再统一等待。
+		// 重试时最新列表里已经没有被抢走的元素，仍然从队首开始，取接下来序号最小的元素
+		int count = std::min(max_items, index_.Size());
+		slots_.resize(count);
+		pthread_mutex_lock(&mutex_);
+		fetching_ = 0;
+		pthread_mutex_unlock(&mutex_);
+		for (int i = 0; i < count; ++i) {
+			FetchSlot& slot = slots_[i];
+			slot.queue = this;
+			slot.name = index_.NameAt(i);
+			std::map<std::string, std::string>::iterator cached = fetched.find(slot.name);
+			if (cached != fetched.end()) {
+				slot.errcode = kZKSucceed;
+				slot.value.swap(cached->second);
+				continue;
+			}
+			slot.errcode = kZKError;
+			slot.value.clear();
+			pthread_mutex_lock(&mutex_);
+			++fetching_;
+			pthread_mutex_unlock(&mutex_);
+			if (!zkclient.GetNode(items_path_ + "/" + slot.name, FetchHandler, &slot)) {
+				pthread_mutex_lock(&mutex_);
+				--fetching_;
+				pthread_mutex_unlock(&mutex_);
+			}
+		}
+		pthread_mutex_lock(&mutex_);
+		while (fetching_) {
+			pthread_cond_wait(&cond_, &mutex_);
+		}
+		pthread_mutex_unlock(&mutex_);
+
+		// 用一次multi删除所有取到数据的元素，删除成功才算取到
+		std::vector<ZKOperation> ops;
+		for (int i = 0; i < count; ++i) {
+			if (slots_[i].errcode == kZKSucceed) {
+				ops.push_back(ZKOperation(kZKOpDelete, items_path_ + "/" + slots_[i].name));
+			} else if (slots_[i].errcode != kZKNotExist) { // 不存在的是被其他消费者取走了
+				return -1;
+			}
+		}
+		ZKErrorCode errcode = ops.empty() ? kZKNotExist : zkclient.Multi(&ops);
+		if (errcode == kZKSucceed) {
+			for (int i = 0; i < count; ++i) {
+				if (slots_[i].errcode == kZKSucceed) {
+					items->push_back(slots_[i].value);
+				}
+				index_.Erase(ZKSequenceIndex::ParseSequence(slots_[i].name.c_str()));
+			}
+			return ops.size();
+		} else if (errcode != kZKNotExist) {
+			return -1;
+		}
+		// 被其他消费者抢先取走，说明队列有进展，重新拉取后重试
+		fetched.clear();
+		for (int i = 0; i < count; ++i) {
+			if (slots_[i].errcode == kZKSucceed) {
+				fetched[slots_[i].name].swap(slots_[i].value);
+			}
+		}
+	}
+}
+
+void ZKQueue::FetchHandler(ZKErrorCode errcode, const std::string& path, const char* value, int value_len,
+		void* context) {
+	FetchSlot* slot = (FetchSlot*)context;
+	slot->errcode = errcode;
+	if (errcode == kZKSucceed) {
+		slot->value.assign(value, value_len);
+	}
+	ZKQueue* queue = slot->queue;
+	pthread_mutex_lock(&queue->mutex_);
+	if (--queue->fetching_ == 0) {
+		pthread_cond_signal(&queue->cond_);
+	}
+	pthread_mutex_unlock(&queue->mutex_);
+}
+
+ZKErrorCode ZKQueue::Wait(int64_t deadline_ms) {
+	ZKClient& zkclient = ZKClient::GetInstance();
+	char buffer[256];
+	if (zkclient.Create(waiters_path_ + "/waiter-", "", ZOO_EPHEMERAL | ZOO_SEQUENCE, buffer, sizeof(buffer)) != kZKSucceed) {
+		return kZKError;
+	}
+	std::string node = buffer;
+	int64_t seq = ZKSequenceIndex::ParseSequence(node.c_str());
+
+	ZKErrorCode result = kZKNotExist;
+	for (;;) {
+		pthread_mutex_lock(&mutex_);
+		uint64_t wakeup_count = wakeup_count_;
+		pthread_mutex_unlock(&mutex_);
+
+		std::vector<std::string> children;
+		if (zkclient.GetChildren(waiters_path_, &children) != kZKSucceed) {
+			result = kZKError;
+			break;
+		}
+		std::vector<char*> names(children.size());
+		for (size_t i = 0; i < children.size(); ++i) {
+			names[i] = (char*)children[i].c_str();
+		}
+		ZKSequenceIndex waiters;
+		waiters.Update(names.size(), names.empty() ? NULL : &names[0]);
+		int predecessor = waiters.Predecessor(seq);
+
+		std::string watch_path;
+		ZKErrorCode errcode;
+		if (predecessor < 0) { // 排在最前面，watch元素列表
+			watch_path = items_path_;
+			std::vector<std::string> items;
+			errcode = zkclient.GetChildren(watch_path, &items, ItemsHandler, this, true);
+			if (errcode == kZKSucceed && !items.empty()) {
+				zkclient.Unwatch(watch_path, ItemsHandler, this);
+				result = kZKSucceed;
+				break;
+			}
+		} else { // 只watch前一个等待者，它离开时再检查
+			watch_path = waiters_path_ + "/" + waiters.NameAt(predecessor);
+			char value[16];
+			int value_len = sizeof(value);
+			errcode = zkclient.GetNode(watch_path, value, &value_len, WaiterHandler, this, true);
+			if (errcode == kZKNotExist) {
+				continue;
+			}
+		}
+		if (errcode != kZKSucceed) {
+			result = kZKError;
+			break;
+		}
+
+		pthread_mutex_lock(&mutex_);
+		bool timeout = false;
+		while (wakeup_count_ == wakeup_count && !timeout) {
+			int64_t wait_ms = deadline_ms - GetCurrentMs();
+			if (wait_ms <= 0) {
+				timeout = true;
+				break;
+			}
+			struct timeval now;
+			gettimeofday(&now, NULL);
+			int64_t ns = (int64_t)now.tv_usec * 1000 + wait_ms * 1000000;
+			struct timespec abstime;
+			abstime.tv_sec = now.tv_sec + ns / 1000000000;
+			abstime.tv_nsec = ns % 1000000000;
+			timeout = pthread_cond_timedwait(&cond_, &mutex_, &abstime) == ETIMEDOUT && wakeup_count_ == wakeup_count;
+		}
+		pthread_mutex_unlock(&mutex_);
+
+		if (predecessor < 0) {
+			zkclient.Unwatch(watch_path, ItemsHandler, this);
+		} else {
+			zkclient.Unwatch(watch_path, WaiterHandler, this);
+		}
+		if (timeout) {
+			break;
+		}
+	}
+	// 离开等待链，下一个等待者随之被唤醒
+	zkclient.Delete(node);
+	return result;
+}
+
+void ZKQueue::Wakeup() {
+	pthread_mutex_lock(&mutex_);
+	++wakeup_count_;
+	pthread_cond_broadcast(&cond_);
+	pthread_mutex_unlock(&mutex_);
+}
+
+void ZKQueue::ItemsHandler(ZKErrorCode errcode, const std::string& path, int count, char** data, void* context) {
+	((ZKQueue*)context)->Wakeup();
+}
+
+void ZKQueue::WaiterHandler(ZKErrorCode errcode, const std::string& path, const char* value, int value_len,
+		void* context) {
+	((ZKQueue*)context)->Wakeup();
+}
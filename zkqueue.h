@@ -0,0 +1,103 @@
+/*
+ * zkqueue.h
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#ifndef ZK_ZKQUEUE_H_
+#define ZK_ZKQUEUE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include "zkclient.h"
+#include "zksequence.h"
+
+/**
+ *		基于顺序节点的分布式FIFO队列，按批次入队和出队。
+ *
+ *		队列节点path下有两个子节点：items存放元素（持久顺序节点"item-"），waiters存放等待中的消费者
+ *		（临时顺序节点"waiter-"）。
+ *
+ *		入队：一批元素用一次multi原子创建（超过kMaxBatchOps个或kMaxBatchBytes字节时拆成多次）。
+ *		出队：一次GetChildren后按序号取最小的至多max_items个，同时发出所有GetNode（流水线），
+ *		再用一次multi批量删除，删除成功才算取到；multi因有元素被其他消费者抢先取走而失败时，
+ *		重新GetChildren，从最新列表的队首重建整批（已取到的数据直接沿用）后重试。
+ *		多个消费者按序号竞争同一批元素，元素既不会丢失也不会被重复取到。
+ *
+ *		队列为空时，消费者在waiters下排队：只有排在最前面的消费者watch元素列表，其余的只watch前一个等待者，
+ *		有元素时队首离开并唤醒下一个，依次传递，每次变化只唤醒一个消费者，避免惊群。
+ *
+ *		线程安全，同一对象的Pop串行执行，需要并发消费时每个线程各用一个对象。
+ *		对象作为watch回调的context，析构前需确保zk回调不会再并发进入。
+ */
+class ZKQueue {
+public:
+	// path为队列节点，父节点需已存在
+	explicit ZKQueue(const std::string& path);
+
+	~ZKQueue();
+
+	// 创建队列节点及其items、waiters子节点。需在ZKClient::Init之后调用
+	bool Init();
+
+	// 入队一个元素
+	ZKErrorCode Push(const std::string& item);
+
+	/*
+	 * 批量入队，同一批内的元素保持顺序。失败时已提交的批次不会回滚，pushed非NULL时返回成功入队的个数。
+	 */
+	ZKErrorCode Push(const std::vector<std::string>& items, int* pushed = NULL);
+
+	/*
+	 * 按入队顺序取出至多max_items个元素，追加到items。
+	 * 队列为空时最多等待timeout_ms，超时返回kZKNotExist；取到至少一个元素返回kZKSucceed。
+	 */
+	ZKErrorCode Pop(std::vector<std::string>* items, int max_items, int timeout_ms);
+
+private:
+	static const int kMaxBatchOps = 500;
+	static const int kMaxBatchBytes = 512 * 1024; // 远小于zk默认1MB的jute.maxbuffer
+
+	// 一次流水线GetNode的结果
+	struct FetchSlot {
+		ZKQueue* queue;
+		std::string name;
+		ZKErrorCode errcode;
+		std::string value;
+	};
+
+	static void FetchHandler(ZKErrorCode errcode, const std::string& path, const char* value, int value_len,
+			void* context);
+	static void ItemsHandler(ZKErrorCode errcode, const std::string& path, int count, char** data, void* context);
+	static void WaiterHandler(ZKErrorCode errcode, const std::string& path, const char* value, int value_len,
+			void* context);
+
+	// 取最小的至多max_items个元素，返回取到的个数，出错返回-1
+	int Claim(std::vector<std::string>* items, int max_items);
+
+	// 在等待链上等到可能有元素为止，超时返回kZKNotExist
+	ZKErrorCode Wait(int64_t deadline_ms);
+	void Wakeup();
+
+	ZKQueue(const ZKQueue&);
+	ZKQueue& operator=(const ZKQueue&);
+
+	std::string path_;
+	std::string items_path_;
+	std::string waiters_path_;
+
+	pthread_mutex_t pop_mutex_; // 串行化Pop，以下两个字段只在Pop内使用
+	ZKSequenceIndex index_; // items的增量有序索引
+	std::vector<FetchSlot> slots_;
+
+	// 流水线GetNode和等待链的唤醒
+	pthread_mutex_t mutex_;
+	pthread_cond_t cond_;
+	int fetching_; // 尚未返回的GetNode个数
+	uint64_t wakeup_count_;
+};
+
+#endif /* ZK_ZKQUEUE_H_ */
@@ -0,0 +1,317 @@
+/*
+ * zkregistry.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <algorithm>
+#include "zkregistry.h"
+
+namespace {
+	int64_t GetCurrentMs() {
+		struct timeval tv;
+		gettimeofday(&tv, NULL);
+		return (int64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+	}
+
+	__thread uint64_t random_state = 0;
+
+	// xorshift64*，每个线程独立的状态，不加锁
+	uint64_t NextRandom() {
+		uint64_t x = random_state;
+		if (!x) {
+			x = ((uint64_t)GetCurrentMs() << 20) ^ (uint64_t)(uintptr_t)&random_state;
+			x |= 1;
+		}
+		x ^= x >> 12;
+		x ^= x << 25;
+		x ^= x >> 27;
+		random_state = x;
+		return x * 2685821657736338717ULL;
+	}
+
+	bool ValidField(const std::string& field, size_t max_len) {
+		return field.size() < max_len && field.find_first_of("/#") == std::string::npos;
+	}
+}
+
+ZKServiceRegistry::ZKServiceRegistry(const std::string& path)
+	: path_(path), snapshot_(NULL), subscribed_(false), notified_(false) {
+	pthread_mutex_init(&mutex_, NULL);
+}
+
+ZKServiceRegistry::~ZKServiceRegistry() {
+	if (subscribed_) {
+		ZKClient::GetInstance().Unwatch(path_, ChildrenHandler, this);
+	}
+	delete snapshot_;
+	for (std::list<std::pair<int64_t, Snapshot*> >::iterator iter = retired_.begin(); iter != retired_.end(); ++iter) {
+		delete iter->second;
+	}
+	pthread_mutex_destroy(&mutex_);
+}
+
+bool ZKServiceRegistry::EncodeName(const std::string& address, int weight, const std::string& zone, std::string* name) {
+	if (address.empty() || weight < 0 || !ValidField(address, sizeof(((ZKEndpoint*)0)->address)) ||
+			!ValidField(zone, sizeof(((ZKEndpoint*)0)->zone))) {
+		return false;
+	}
+	char buffer[16];
+	snprintf(buffer, sizeof(buffer), "%d", weight);
+	name->assign(address).append("#").append(buffer).append("#").append(zone);
+	return true;
+}
+
+bool ZKServiceRegistry::ParseName(const char* name, ZKEndpoint* endpoint) {
+	const char* weight = strchr(name, '#');
+	if (!weight || weight == name || weight - name >= (int)sizeof(endpoint->address)) {
+		return false;
+	}
+	const char* zone = strchr(weight + 1, '#');
+	if (!zone || strchr(zone + 1, '#') || strlen(zone + 1) >= sizeof(endpoint->zone)) {
+		return false;
+	}
+	char* end = NULL;
+	long value = strtol(weight + 1, &end, 10);
+	if (end != zone || end == weight + 1 || value < 0 || value > 0x7fffffff) {
+		return false;
+	}
+	memset(endpoint, 0, sizeof(*endpoint));
+	memcpy(endpoint->address, name, weight - name);
+	strcpy(endpoint->zone, zone + 1);
+	endpoint->weight = (int)value;
+	return true;
+}
+
+ZKErrorCode ZKServiceRegistry::Advertise(const std::string& address, int weight, const std::string& zone) {
+	std::string name;
+	if (!EncodeName(address, weight, zone, &name)) {
+		return kZKError;
+	}
+	ZKClient& zkclient = ZKClient::GetInstance();
+	ZKErrorCode errcode = zkclient.Create(path_, "", 0);
+	if (errcode != kZKSucceed && errcode != kZKExisted) {
+		return errcode;
+	}
+
+	pthread_mutex_lock(&mutex_);
+	DeleteStaleNodes();
+	std::string node = path_ + "/" + name;
+	std::map<std::string, std::string>::iterator iter = advertised_.find(address);
+	if (iter != advertised_.end() && iter->second == node) { // 已经注册过
+		pthread_mutex_unlock(&mutex_);
+		return kZKSucceed;
+	}
+	// 先创建新节点再删除旧节点，修改元数据期间实例不会从订阅方的列表里消失，创建失败时旧节点保持不变
+	errcode = zkclient.Create(node, "", ZOO_EPHEMERAL);
+	if (errcode == kZKExisted) {
+		// 恢复会话或重建会话后节点可能已经由本会话创建，属于本会话则视为注册成功
+		struct Stat stat;
+		if (zkclient.Exist(node, &stat) == kZKSucceed && stat.ephemeralOwner == zkclient.GetSessionId()) {
+			errcode = kZKSucceed;
+		}
+	}
+	if (errcode != kZKSucceed) {
+		pthread_mutex_unlock(&mutex_);
+		return errcode;
+	}
+	if (iter != advertised_.end()) {
+		stale_nodes_.push_back(iter->second);
+	}
+	advertised_[address] = node;
+	errcode = DeleteStaleNodes() ? kZKSucceed : kZKError;
+	pthread_mutex_unlock(&mutex_);
+	return errcode;
+}
+
+bool ZKServiceRegistry::DeleteStaleNodes() {
+	ZKClient& zkclient = ZKClient::GetInstance();
+	std::vector<std::string> failed;
+	for (size_t i = 0; i < stale_nodes_.size(); ++i) {
+		ZKErrorCode errcode = zkclient.Delete(stale_nodes_[i]);
+		if (errcode != kZKSucceed && errcode != kZKNotExist) {
+			failed.push_back(stale_nodes_[i]);
+		}
+	}
+	stale_nodes_.swap(failed);
+	return stale_nodes_.empty();
+}
+
+ZKErrorCode ZKServiceRegistry::Withdraw(const std::string& address) {
+	pthread_mutex_lock(&mutex_);
+	DeleteStaleNodes();
+	std::map<std::string, std::string>::iterator iter = advertised_.find(address);
+	if (iter == advertised_.end()) {
+		pthread_mutex_unlock(&mutex_);
+		return kZKNotExist;
+	}
+	ZKErrorCode errcode = ZKClient::GetInstance().Delete(iter->second);
+	if (errcode == kZKSucceed || errcode == kZKNotExist) {
+		advertised_.erase(iter);
+		errcode = kZKSucceed;
+	}
+	pthread_mutex_unlock(&mutex_);
+	return errcode;
+}
+
+bool ZKServiceRegistry::Subscribe() {
+	ZKClient& zkclient = ZKClient::GetInstance();
+	ZKErrorCode errcode = zkclient.Create(path_, "", 0);
+	if (errcode != kZKSucceed && errcode != kZKExisted) {
+		return false;
+	}
+
+	pthread_mutex_lock(&mutex_);
+	if (subscribed_) {
+		pthread_mutex_unlock(&mutex_);
+		return true;
+	}
+	subscribed_ = true;
+	notified_ = false;
+	pthread_mutex_unlock(&mutex_);
+
+	std::vector<std::string> children;
+	errcode = zkclient.GetChildren(path_, &children, ChildrenHandler, this, true);
+
+	pthread_mutex_lock(&mutex_);
+	if (errcode != kZKSucceed) {
+		subscribed_ = false;
+		pthread_mutex_unlock(&mutex_);
+		return false;
+	}
+	if (!notified_) { // 变化通知可能先于同步调用返回，那时的列表更新
+		Publish(children);
+	}
+	pthread_mutex_unlock(&mutex_);
+	return true;
+}
+
+void ZKServiceRegistry::Update(const std::vector<std::string>& children) {
+	pthread_mutex_lock(&mutex_);
+	Publish(children);
+	pthread_mutex_unlock(&mutex_);
+}
+
+void ZKServiceRegistry::ChildrenHandler(ZKErrorCode errcode, const std::string& path, int count, char** data,
+		void* context) {
+	ZKServiceRegistry* registry = (ZKServiceRegistry*)context;
+	registry->OnChildren(errcode, count, data);
+}
+
+void ZKServiceRegistry::OnChildren(ZKErrorCode errcode, int count, char** data) {
+	pthread_mutex_lock(&mutex_);
+	notified_ = true;
+	if (errcode == kZKSucceed || errcode == kZKStale) {
+		Publish(std::vector<std::string>(data, data + count));
+	} else if (errcode == kZKDeleted || errcode == kZKNotExist) { // 服务节点被删除，订阅结束
+		Publish(std::vector<std::string>());
+		subscribed_ = false;
+	} else { // watch失效，保留最后的快照继续使用，可以重新Subscribe
+		subscribed_ = false;
+	}
+	pthread_mutex_unlock(&mutex_);
+}
+
+void ZKServiceRegistry::Publish(const std::vector<std::string>& children) {
+	std::vector<std::string> names(children);
+	std::sort(names.begin(), names.end());
+
+	Snapshot* old = snapshot_;
+	Snapshot* snapshot = new Snapshot;
+	int64_t total_weight = 0;
+	size_t old_index = 0;
+	for (size_t i = 0; i < names.size(); ++i) {
+		// 两份列表都有序，沿用旧快照里已解析的实例，只解析新增的子节点
+		while (old && old_index < old->names.size() && old->names[old_index] < names[i]) {
+			++old_index;
+		}
+		ZKEndpoint endpoint;
+		if (old && old_index < old->names.size() && old->names[old_index] == names[i]) {
+			endpoint = old->endpoints[old_index];
+		} else if (!ParseName(names[i].c_str(), &endpoint)) { // 不是服务实例的子节点，忽略
+			continue;
+		}
+		total_weight += endpoint.weight;
+		snapshot->names.push_back(names[i]);
+		snapshot->endpoints.push_back(endpoint);
+		snapshot->bounds.push_back(total_weight);
+	}
+
+	// 快照写完后再发布指针
+	__sync_synchronize();
+	snapshot_ = snapshot;
+
+	int64_t now_ms = GetCurrentMs();
+	while (!retired_.empty() && retired_.front().first <= now_ms) {
+		delete retired_.front().second;
+		retired_.pop_front();
+	}
+	if (old) {
+		retired_.push_back(std::make_pair(now_ms + kRetireDelayMs, old));
+	}
+}
+
+int ZKServiceRegistry::PickIndex(const Snapshot* snapshot) const {
+	int64_t total_weight = snapshot->bounds.empty() ? 0 : snapshot->bounds.back();
+	if (total_weight <= 0) {
+		return -1;
+	}
+	// 第一个前缀和大于point的实例，权重为0的实例前缀和与前一个相同，不会被选中
+	int64_t point = NextRandom() % total_weight;
+	return std::upper_bound(snapshot->bounds.begin(), snapshot->bounds.end(), point) - snapshot->bounds.begin();
+}
+
+bool ZKServiceRegistry::Pick(ZKEndpoint* endpoint) const {
+	const Snapshot* snapshot = snapshot_;
+	if (!snapshot) {
+		return false;
+	}
+	int index = PickIndex(snapshot);
+	if (index < 0) {
+		return false;
+	}
+	*endpoint = snapshot->endpoints[index];
+	return true;
+}
+
+bool ZKServiceRegistry::PickTwo(ZKEndpoint* first, ZKEndpoint* second) const {
+	const Snapshot* snapshot = snapshot_;
+	if (!snapshot) {
+		return false;
+	}
+	int first_index = PickIndex(snapshot);
+	if (first_index < 0) {
+		return false;
+	}
+	// 第二个在其余实例中按权重随机：跳过第一个实例占的区间[low, high)
+	int64_t high = snapshot->bounds[first_index];
+	int64_t low = first_index ? snapshot->bounds[first_index - 1] : 0;
+	int64_t rest_weight = snapshot->bounds.back() - (high - low);
+	int second_index = first_index;
+	if (rest_weight > 0) {
+		int64_t point = NextRandom() % rest_weight;
+		if (point >= low) {
+			point += high - low;
+		}
+		second_index = std::upper_bound(snapshot->bounds.begin(), snapshot->bounds.end(), point) - snapshot->bounds.begin();
+	}
+	*first = snapshot->endpoints[first_index];
+	*second = snapshot->endpoints[second_index];
+	return true;
+}
+
+int ZKServiceRegistry::GetEndpoints(std::vector<ZKEndpoint>* endpoints) const {
+	const Snapshot* snapshot = snapshot_;
+	if (!snapshot) {
+		endpoints->clear();
+		return 0;
+	}
+	endpoints->assign(snapshot->endpoints.begin(), snapshot->endpoints.end());
+	return endpoints->size();
+}
@@ -0,0 +1,112 @@
+/*
+ * zkregistry.h
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#ifndef ZK_ZKREGISTRY_H_
+#define ZK_ZKREGISTRY_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <list>
+#include <map>
+#include <string>
+#include <vector>
+#include "zkclient.h"
+
+// 一个服务实例，字段都是定长的，快照里是一个连续数组
+struct ZKEndpoint {
+	char address[64]; // host:port
+	char zone[32]; // 机房等分组标识，可以为空
+	int weight; // 0表示不参与Pick（例如摘流量）
+};
+
+/**
+ *		服务注册与发现。
+ *
+ *		服务节点path下每个临时子节点是一个服务实例，元数据编码在子节点名里："address#weight#zone"，
+ *		所以成员变化只需要一次GetChildren，不需要再逐个GetNode。
+ *
+ *		订阅后子节点列表每次变化，都增量生成一份新的只读快照（已解析的实例直接沿用，只解析新增的子节点），
+ *		快照是ZKEndpoint数组加权重前缀和，用一次指针替换发布。Pick/PickTwo只读取当前快照，不加锁，
+ *		按权重随机是O(logN)的二分查找。被替换的快照延迟kRetireDelayMs后才释放：
+ *		Pick/PickTwo/GetEndpoints都不在返回后保留快照指针，单次调用远小于这个时间。
+ *
+ *		线程安全。析构时取消订阅，析构前需确保zk回调不会再并发进入（例如在ZKClient退出后或程序退出时析构）。
+ */
+class ZKServiceRegistry {
+public:
+	// path为服务节点，不存在时Subscribe/Advertise会以空值创建，父节点需已存在
+	explicit ZKServiceRegistry(const std::string& path);
+
+	~ZKServiceRegistry();
+
+	/*
+	 * 注册本进程的服务实例，创建临时子节点。address和zone不能包含'/'和'#'。
+	 * 同一address再次注册时先创建新节点再删除旧节点，用于修改权重。
+	 * 旧节点删除失败时返回kZKError，新节点已经生效，旧节点在之后的Advertise/Withdraw里重试删除。
+	 */
+	ZKErrorCode Advertise(const std::string& address, int weight, const std::string& zone = "");
+
+	// 注销本进程注册的服务实例
+	ZKErrorCode Withdraw(const std::string& address);
+
+	// 订阅服务节点的实例列表，同步拿到第一份快照。需在ZKClient::Init之后调用
+	bool Subscribe();
+
+	// 不经过zk，直接用给定的子节点名生成并发布快照，例如从其他来源同步实例列表；已订阅时会被之后的变化覆盖
+	void Update(const std::vector<std::string>& children);
+
+	/*
+	 * 负载均衡热路径，不加锁。
+	 * Pick按权重随机选一个实例；PickTwo按权重随机选两个不同的实例（只有一个可用实例时两个相同），
+	 * 由调用方比较两者的负载选较小的(power of two choices)。没有可用实例返回false。
+	 */
+	bool Pick(ZKEndpoint* endpoint) const;
+
+	bool PickTwo(ZKEndpoint* first, ZKEndpoint* second) const;
+
+	// 当前快照里的所有实例（包括权重为0的），返回实例数
+	int GetEndpoints(std::vector<ZKEndpoint>* endpoints) const;
+
+	// 编码/解析子节点名
+	static bool EncodeName(const std::string& address, int weight, const std::string& zone, std::string* name);
+
+	static bool ParseName(const char* name, ZKEndpoint* endpoint);
+
+private:
+	static const int kRetireDelayMs = 10000;
+
+	// 只读快照，names与endpoints一一对应，按名字升序
+	struct Snapshot {
+		std::vector<std::string> names;
+		std::vector<ZKEndpoint> endpoints;
+		std::vector<int64_t> bounds; // 权重前缀和，bounds[i]为前i+1个实例的权重之和
+	};
+
+	static void ChildrenHandler(ZKErrorCode errcode, const std::string& path, int count, char** data, void* context);
+
+	void OnChildren(ZKErrorCode errcode, int count, char** data);
+	void Publish(const std::vector<std::string>& children);
+	int PickIndex(const Snapshot* snapshot) const;
+	// 删除修改元数据后遗留的旧节点，全部删除返回true，需持有mutex_
+	bool DeleteStaleNodes();
+
+	ZKServiceRegistry(const ZKServiceRegistry&);
+	ZKServiceRegistry& operator=(const ZKServiceRegistry&);
+
+	std::string path_;
+	Snapshot* volatile snapshot_; // 当前快照，Pick无锁读取
+
+	// 以下字段由mutex_保护
+	bool subscribed_;
+	bool notified_; // 订阅后已经收到过变化通知
+	std::list<std::pair<int64_t, Snapshot*> > retired_; // (可以释放的时间, 快照)
+	std::map<std::string, std::string> advertised_; // address -> 本进程创建的临时节点
+	std::vector<std::string> stale_nodes_; // 已被新节点替换但还没删除成功的旧节点
+	pthread_mutex_t mutex_;
+};
+
+#endif /* ZK_ZKREGISTRY_H_ */
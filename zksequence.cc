@@ -0,0 +1,170 @@
+/*
+ * zksequence.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#include <string.h>
+#include <algorithm>
+#include "zksequence.h"
+
+namespace {
+	// ZOO_SEQUENCE生成的后缀固定为10位数字
+	const size_t kSequenceDigits = 10;
+
+	bool SameSequence(const std::pair<int64_t, int>& lhs, const std::pair<int64_t, int>& rhs) {
+		return lhs.first == rhs.first;
+	}
+}
+
+ZKSequenceIndex::ZKSequenceIndex() : garbage_(0) {
+}
+
+int64_t ZKSequenceIndex::ParseSequence(const char* name) {
+	size_t len = strlen(name);
+	if (len < kSequenceDigits) {
+		return -1;
+	}
+	int64_t seq = 0;
+	for (const char* p = name + len - kSequenceDigits; *p; ++p) {
+		if (*p < '0' || *p > '9') {
+			return -1;
+		}
+		seq = seq * 10 + (*p - '0');
+	}
+	return seq;
+}
+
+int ZKSequenceIndex::LowerBound(int64_t seq) const {
+	Entry key = { seq, 0 };
+	return std::lower_bound(entries_.begin(), entries_.end(), key) - entries_.begin();
+}
+
+int ZKSequenceIndex::Find(int64_t seq) const {
+	int index = LowerBound(seq);
+	return index < (int)entries_.size() && entries_[index].seq == seq ? index : -1;
+}
+
+int ZKSequenceIndex::Predecessor(int64_t seq) const {
+	return LowerBound(seq) - 1;
+}
+
+int ZKSequenceIndex::Successor(int64_t seq) const {
+	int index = LowerBound(seq + 1);
+	return index < (int)entries_.size() ? index : -1;
+}
+
+uint32_t ZKSequenceIndex::AddName(const char* name) {
+	uint32_t offset = names_.size();
+	names_.append(name, strlen(name) + 1);
+	return offset;
+}
+
+bool ZKSequenceIndex::Insert(const char* name) {
+	int64_t seq = ParseSequence(name);
+	if (seq < 0) {
+		return false;
+	}
+	int index = LowerBound(seq);
+	if (index < (int)entries_.size() && entries_[index].seq == seq) {
+		return false;
+	}
+	Entry entry = { seq, AddName(name) };
+	entries_.insert(entries_.begin() + index, entry);
+	return true;
+}
+
+bool ZKSequenceIndex::Erase(int64_t seq) {
+	int index = Find(seq);
+	if (index < 0) {
+		return false;
+	}
+	garbage_ += strlen(NameAt(index)) + 1;
+	entries_.erase(entries_.begin() + index);
+	if (garbage_ * 2 > names_.size()) {
+		Compact();
+	}
+	return true;
+}
+
+void ZKSequenceIndex::Clear() {
+	entries_.clear();
+	names_.clear();
+	garbage_ = 0;
+}
+
+int ZKSequenceIndex::Update(int count, char** children, std::vector<std::string>* added,
+		std::vector<std::string>* removed) {
+	// 每个子节点在现有索引里二分查找：找到的标记为仍然存在，找不到的是新增；没有被标记的现有条目是删除。
+	// 只对新增的少量子节点排序，索引本身原地删除、原地归并，不重建整个数组
+	std::vector<bool> present(entries_.size(), false);
+	std::vector<std::pair<int64_t, int> > latest_added;
+	for (int i = 0; i < count; ++i) {
+		int64_t seq = ParseSequence(children[i]);
+		if (seq < 0) {
+			continue;
+		}
+		int index = Find(seq);
+		if (index >= 0) {
+			present[index] = true;
+		} else {
+			latest_added.push_back(std::make_pair(seq, i));
+		}
+	}
+	std::sort(latest_added.begin(), latest_added.end());
+	latest_added.erase(std::unique(latest_added.begin(), latest_added.end(), SameSequence), latest_added.end());
+
+	int changes = 0;
+	size_t kept = 0;
+	for (size_t i = 0; i < entries_.size(); ++i) {
+		if (present[i]) {
+			entries_[kept++] = entries_[i];
+			continue;
+		}
+		if (removed) {
+			removed->push_back(NameAt(i));
+		}
+		garbage_ += strlen(NameAt(i)) + 1;
+		++changes;
+	}
+	entries_.resize(kept);
+
+	if (!latest_added.empty()) {
+		// 从尾部归并，已有条目最多各移动一次
+		int i = (int)kept - 1;
+		int j = (int)latest_added.size() - 1;
+		entries_.resize(kept + latest_added.size());
+		for (int k = (int)entries_.size() - 1; j >= 0; --k) {
+			if (i >= 0 && entries_[i].seq > latest_added[j].first) {
+				entries_[k] = entries_[i--];
+			} else {
+				Entry entry = { latest_added[j].first, AddName(children[latest_added[j].second]) };
+				entries_[k] = entry;
+				--j;
+			}
+		}
+		for (size_t k = 0; k < latest_added.size(); ++k) {
+			if (added) {
+				added->push_back(children[latest_added[k].second]);
+			}
+			++changes;
+		}
+	}
+	if (garbage_ * 2 > names_.size()) {
+		Compact();
+	}
+	return changes;
+}
+
+void ZKSequenceIndex::Compact() {
+	std::string names;
+	names.reserve(names_.size() - garbage_);
+	for (size_t i = 0; i < entries_.size(); ++i) {
+		const char* name = NameAt(i);
+		entries_[i].offset = names.size();
+		names.append(name, strlen(name) + 1);
+	}
+	names_.swap(names);
+	garbage_ = 0;
+}
@@ -0,0 +1,84 @@
+/*
+ * zksequence.h
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#ifndef ZK_ZKSEQUENCE_H_
+#define ZK_ZKSEQUENCE_H_
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/**
+ *		顺序节点(ZOO_SEQUENCE)的有序索引，用于选主、队列、锁等按序号排队的场景。
+ *
+ *		子节点名的10位数字后缀解析为整数作为key，索引是按序号排好的扁平数组(序号, 名字偏移)，
+ *		名字统一存放在一块连续内存里。每次GetChildren回调后用Update做增量更新，只处理新增/删除的子节点，
+ *		查询最小、前驱、后继都是O(logN)的二分查找，不需要每次都对字符串排序。
+ *
+ *		非线程安全，通常只在zk回调线程里使用。
+ */
+class ZKSequenceIndex {
+public:
+	ZKSequenceIndex();
+
+	// 解析子节点名的10位序号后缀，不是顺序节点返回-1
+	static int64_t ParseSequence(const char* name);
+
+	/*
+	 * 用GetChildren返回的完整子节点列表更新索引，返回新增和删除的子节点数之和。
+	 * 非顺序节点被忽略；added/removed非NULL时返回新增/删除的子节点名。
+	 */
+	int Update(int count, char** children, std::vector<std::string>* added = NULL,
+			std::vector<std::string>* removed = NULL);
+
+	// 增量插入/删除单个子节点，已存在/不存在返回false
+	bool Insert(const char* name);
+
+	bool Erase(int64_t seq);
+
+	void Clear();
+
+	/* 查询返回数组下标，不存在返回-1 */
+	int Size() const { return entries_.size(); }
+
+	int Min() const { return entries_.empty() ? -1 : 0; }
+
+	int Max() const { return (int)entries_.size() - 1; }
+
+	int Find(int64_t seq) const;
+
+	// 序号小于seq的最大者
+	int Predecessor(int64_t seq) const;
+
+	// 序号大于seq的最小者
+	int Successor(int64_t seq) const;
+
+	int64_t SeqAt(int index) const { return entries_[index].seq; }
+
+	// 返回的指针在下一次修改索引前有效
+	const char* NameAt(int index) const { return names_.data() + entries_[index].offset; }
+
+private:
+	struct Entry {
+		int64_t seq;
+		uint32_t offset; // 名字在names_中的偏移
+
+		bool operator<(const Entry& other) const { return seq < other.seq; }
+	};
+
+	// 第一个序号不小于seq的下标
+	int LowerBound(int64_t seq) const;
+
+	uint32_t AddName(const char* name);
+	void Compact();
+
+	std::vector<Entry> entries_; // 按序号升序
+	std::string names_; // 以'\0'结尾依次存放的子节点名
+	size_t garbage_; // names_中已删除的名字占用的字节数，超过一半时压缩
+};
+
+#endif /* ZK_ZKSEQUENCE_H_ */
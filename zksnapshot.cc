@@ -0,0 +1,193 @@
+/*
+ * zksnapshot.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "zkclient.h"
+#include "zksnapshot.h"
+
+namespace {
+	const char kSnapshotMagic[8] = { 'Z', 'K', 'S', 'N', 'A', 'P', '\0', '\0' };
+	const uint32_t kSnapshotVersion = 1;
+
+	struct SnapshotHeader {
+		char magic[8];
+		uint32_t version;
+		uint32_t count;
+		uint64_t body_len;
+		uint64_t checksum;
+	};
+
+	struct RecordHeader {
+		uint32_t type;
+		uint32_t path_len;
+		uint32_t value_len;
+		uint32_t count;
+		struct Stat stat;
+	};
+
+	// FNV-1a 64位
+	uint64_t Checksum(const char* data, size_t len) {
+		uint64_t hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < len; ++i) {
+			hash ^= (unsigned char)data[i];
+			hash *= 1099511628211ULL;
+		}
+		return hash;
+	}
+
+	size_t Align8(size_t len) {
+		return (len + 7) & ~(size_t)7;
+	}
+
+	void AppendRecord(std::string* buffer, int type, const std::string& path, const std::string& value,
+			uint32_t count, const struct Stat& stat) {
+		RecordHeader header;
+		memset(&header, 0, sizeof(header));
+		header.type = type;
+		header.path_len = path.size();
+		header.value_len = value.size();
+		header.count = count;
+		header.stat = stat;
+		buffer->append((const char*)&header, sizeof(header));
+		buffer->append(path);
+		buffer->append(value);
+		buffer->resize(Align8(buffer->size()), '\0');
+	}
+}
+
+ZKSnapshot::ZKSnapshot() : addr_(NULL), length_(0) {
+}
+
+ZKSnapshot::~ZKSnapshot() {
+	Unmap();
+}
+
+void ZKSnapshot::Unmap() {
+	records_.clear();
+	if (addr_) {
+		munmap(addr_, length_);
+		addr_ = NULL;
+		length_ = 0;
+	}
+}
+
+bool ZKSnapshot::Load(const std::string& file) {
+	Unmap();
+
+	int fd = open(file.c_str(), O_RDONLY);
+	if (fd < 0) {
+		return false;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(SnapshotHeader)) {
+		close(fd);
+		return false;
+	}
+	void* addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (addr == MAP_FAILED) {
+		return false;
+	}
+	addr_ = addr;
+	length_ = st.st_size;
+
+	const char* base = (const char*)addr_;
+	SnapshotHeader header;
+	memcpy(&header, base, sizeof(header));
+	if (memcmp(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic)) != 0 || header.version != kSnapshotVersion ||
+			header.body_len != length_ - sizeof(header) ||
+			header.checksum != Checksum(base + sizeof(header), header.body_len)) {
+		Unmap();
+		return false;
+	}
+
+	size_t offset = sizeof(header);
+	for (uint32_t i = 0; i < header.count; ++i) {
+		RecordHeader record_header;
+		if (offset + sizeof(record_header) > length_) {
+			Unmap();
+			return false;
+		}
+		memcpy(&record_header, base + offset, sizeof(record_header));
+		offset += sizeof(record_header);
+		if (offset + record_header.path_len + record_header.value_len > length_) {
+			Unmap();
+			return false;
+		}
+		ZKSnapshotRecord& record = records_[std::make_pair((int)record_header.type,
+				std::string(base + offset, record_header.path_len))];
+		offset += record_header.path_len;
+		record.type = record_header.type;
+		record.stat = record_header.stat;
+		record.value = base + offset;
+		record.value_len = record_header.value_len;
+		// 子节点名以'\0'结尾，直接引用映射的内存。校验和只能发现损坏，不能保证记录格式正确，
+		// 每个名字都必须在本条记录之内结束，否则整个快照作废
+		const char* name = record.value;
+		const char* end = record.value + record.value_len;
+		for (uint32_t j = 0; j < record_header.count; ++j) {
+			const char* terminator = name < end ? (const char*)memchr(name, '\0', end - name) : NULL;
+			if (!terminator) {
+				Unmap();
+				return false;
+			}
+			record.children.push_back((char*)name);
+			name = terminator + 1;
+		}
+		offset = Align8(offset + record_header.value_len);
+	}
+	return true;
+}
+
+const ZKSnapshotRecord* ZKSnapshot::Find(int type, const std::string& path) const {
+	std::map<std::pair<int, std::string>, ZKSnapshotRecord>::const_iterator iter =
+			records_.find(std::make_pair(type, path));
+	return iter == records_.end() ? NULL : &iter->second;
+}
+
+void ZKSnapshot::AppendNode(std::string* buffer, const std::string& path, const std::string& value,
+		const struct Stat& stat) {
+	AppendRecord(buffer, kZKWatchNode, path, value, 0, stat);
+}
+
+void ZKSnapshot::AppendChildren(std::string* buffer, const std::string& path, const std::vector<std::string>& children,
+		const struct Stat& stat) {
+	std::string value;
+	for (size_t i = 0; i < children.size(); ++i) {
+		value.append(children[i].c_str(), children[i].size() + 1);
+	}
+	AppendRecord(buffer, kZKWatchChildren, path, value, children.size(), stat);
+}
+
+bool ZKSnapshot::Save(const std::string& file, const std::string& buffer, uint32_t count) {
+	SnapshotHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, kSnapshotMagic, sizeof(kSnapshotMagic));
+	header.version = kSnapshotVersion;
+	header.count = count;
+	header.body_len = buffer.size();
+	header.checksum = Checksum(buffer.data(), buffer.size());
+
+	// 先写临时文件再rename，保证进程随时挂掉都不会留下半个文件
+	std::string tmp_file = file + ".tmp";
+	FILE* fp = fopen(tmp_file.c_str(), "w");
+	if (!fp) {
+		return false;
+	}
+	bool succeed = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+			(buffer.empty() || fwrite(buffer.data(), buffer.size(), 1, fp) == 1);
+	if (fclose(fp) != 0 || !succeed) {
+		unlink(tmp_file.c_str());
+		return false;
+	}
+	return rename(tmp_file.c_str(), file.c_str()) == 0;
+}
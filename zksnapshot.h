@@ -0,0 +1,65 @@
+/*
+ * zksnapshot.h
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#ifndef ZK_ZKSNAPSHOT_H_
+#define ZK_ZKSNAPSHOT_H_
+
+#include <stdint.h>
+#include <string>
+#include <map>
+#include <vector>
+#include "zookeeper.h"
+
+/**
+ *		watch数据的本地快照，用于zk不可用时的热启动。
+ *
+ *		文件格式: 32字节文件头(magic, 版本, 记录数, 数据长度, 校验和) + 若干条记录，每条记录按8字节对齐:
+ *		记录头(类型, path长度, value长度, 子节点个数, Stat) + path + value（子节点记录为'\0'分隔的子节点名）。
+ *		加载时整个文件mmap到内存，校验通过后记录直接引用映射的内存，不做拷贝。
+ */
+
+struct ZKSnapshotRecord {
+	int type; // ZKWatchType，只会是kZKWatchNode或者kZKWatchChildren
+	struct Stat stat;
+	const char* value; // 节点数据，指向映射的内存
+	int value_len;
+	std::vector<char*> children; // 子节点名，指向映射的内存
+};
+
+class ZKSnapshot {
+public:
+	ZKSnapshot();
+	~ZKSnapshot();
+
+	// 加载快照，文件不存在、格式或校验和不对都返回false
+	bool Load(const std::string& file);
+
+	const ZKSnapshotRecord* Find(int type, const std::string& path) const;
+
+	size_t Size() const { return records_.size(); }
+
+	/* 生成快照 */
+	static void AppendNode(std::string* buffer, const std::string& path, const std::string& value, const struct Stat& stat);
+
+	static void AppendChildren(std::string* buffer, const std::string& path, const std::vector<std::string>& children,
+			const struct Stat& stat);
+
+	// 将Append生成的记录加上文件头写入文件（先写临时文件再rename）
+	static bool Save(const std::string& file, const std::string& buffer, uint32_t count);
+
+private:
+	ZKSnapshot(const ZKSnapshot&);
+	ZKSnapshot& operator=(const ZKSnapshot&);
+
+	void Unmap();
+
+	void* addr_;
+	size_t length_;
+	std::map<std::pair<int, std::string>, ZKSnapshotRecord> records_;
+};
+
+#endif /* ZK_ZKSNAPSHOT_H_ */
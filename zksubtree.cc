@@ -0,0 +1,354 @@
+/*
+ * zksubtree.cc
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#include <errno.h>
+#include <sys/time.h>
+#include "zksubtree.h"
+
+ZKSubtreeWatcher::ZKSubtreeWatcher(const std::string& path, int capacity)
+	: path_(path), capacity_(capacity > 0 ? capacity : 1), started_(false), stopped_(false), overflowed_(false),
+	  waiting_root_(false) {
+	pthread_mutex_init(&mutex_, NULL);
+	pthread_cond_init(&cond_, NULL);
+}
+
+ZKSubtreeWatcher::~ZKSubtreeWatcher() {
+	Stop();
+	pthread_cond_destroy(&cond_);
+	pthread_mutex_destroy(&mutex_);
+}
+
+bool ZKSubtreeWatcher::Start() {
+	if (path_.empty() || path_[0] != '/' || (path_.size() > 1 && path_[path_.size() - 1] == '/')) {
+		return false;
+	}
+	pthread_mutex_lock(&mutex_);
+	if (started_) {
+		pthread_mutex_unlock(&mutex_);
+		return false;
+	}
+	started_ = true;
+	nodes_[path_].node_watched = true;
+	pthread_mutex_unlock(&mutex_);
+
+	// 子节点列表在拿到节点数据后再订阅，保证父节点的新增事件先于子节点
+	if (!ZKClient::GetInstance().GetNode(path_, NodeHandler, this, true)) {
+		pthread_mutex_lock(&mutex_);
+		started_ = false;
+		nodes_.clear();
+		pthread_mutex_unlock(&mutex_);
+		return false;
+	}
+	return true;
+}
+
+void ZKSubtreeWatcher::Stop() {
+	std::vector<std::string> paths;
+	pthread_mutex_lock(&mutex_);
+	if (!started_ || stopped_) {
+		pthread_mutex_unlock(&mutex_);
+		return;
+	}
+	stopped_ = true;
+	for (std::map<std::string, Node>::iterator iter = nodes_.begin(); iter != nodes_.end(); ++iter) {
+		paths.push_back(iter->first);
+	}
+	nodes_.clear();
+	waiting_root_ = false;
+	pthread_cond_broadcast(&cond_);
+	pthread_mutex_unlock(&mutex_);
+
+	ZKClient& zkclient = ZKClient::GetInstance();
+	for (size_t i = 0; i < paths.size(); ++i) {
+		zkclient.Unwatch(paths[i], NodeHandler, this);
+		zkclient.Unwatch(paths[i], ChildrenHandler, this);
+	}
+	zkclient.Unwatch(path_, ExistHandler, this);
+}
+
+int ZKSubtreeWatcher::Poll(std::vector<ZKChangeEvent>* events, int max_events, int timeout_ms) {
+	pthread_mutex_lock(&mutex_);
+	if (events_.empty() && timeout_ms > 0) {
+		struct timeval now;
+		gettimeofday(&now, NULL);
+		int64_t ns = (int64_t)now.tv_usec * 1000 + (int64_t)timeout_ms * 1000000;
+		struct timespec abstime;
+		abstime.tv_sec = now.tv_sec + ns / 1000000000;
+		abstime.tv_nsec = ns % 1000000000;
+		while (events_.empty() && !stopped_) {
+			if (pthread_cond_timedwait(&cond_, &mutex_, &abstime) == ETIMEDOUT) {
+				break;
+			}
+		}
+	}
+	int count = 0;
+	while (!events_.empty() && count < max_events) {
+		events->push_back(events_.front());
+		events_.pop_front();
+		++count;
+	}
+	pthread_mutex_unlock(&mutex_);
+	return count;
+}
+
+int ZKSubtreeWatcher::Resync(std::vector<ZKChangeEvent>* events) {
+	pthread_mutex_lock(&mutex_);
+	int count = 0;
+	for (std::map<std::string, Node>::iterator iter = nodes_.begin(); iter != nodes_.end(); ++iter) {
+		const Node& node = iter->second;
+		if (!node.added) {
+			continue;
+		}
+		ZKChangeEvent event;
+		event.type = kZKNodeAdded;
+		event.path = iter->first;
+		event.value = node.value;
+		event.stat = node.stat;
+		event.zxid = node.stat.czxid;
+		events->push_back(event);
+		++count;
+	}
+	events_.clear();
+	overflowed_ = false;
+	pthread_mutex_unlock(&mutex_);
+	return count;
+}
+
+void ZKSubtreeWatcher::NodeHandler(ZKErrorCode errcode, const std::string& path, const char* value, int value_len,
+		void* context) {
+	((ZKSubtreeWatcher*)context)->OnNode(errcode, path, value, value_len);
+}
+
+void ZKSubtreeWatcher::ChildrenHandler(ZKErrorCode errcode, const std::string& path, int count, char** data,
+		void* context) {
+	((ZKSubtreeWatcher*)context)->OnChildren(errcode, path, count, data);
+}
+
+void ZKSubtreeWatcher::ExistHandler(ZKErrorCode errcode, const std::string& path, const struct Stat* stat,
+		void* context) {
+	((ZKSubtreeWatcher*)context)->OnExist(errcode);
+}
+
+void ZKSubtreeWatcher::OnNode(ZKErrorCode errcode, const std::string& path, const char* value, int value_len) {
+	struct Stat stat;
+	memset(&stat, 0, sizeof(stat));
+	if (errcode == kZKSucceed || errcode == kZKStale) {
+		// 回调时仍持有ZKClient的watch锁，缓存就是本次回调的数据
+		ZKClient::GetInstance().GetCachedNode(path, NULL, &stat);
+	}
+
+	Operations operations;
+	pthread_mutex_lock(&mutex_);
+	std::map<std::string, Node>::iterator iter = nodes_.find(path);
+	if (stopped_ || iter == nodes_.end()) {
+		pthread_mutex_unlock(&mutex_);
+		return;
+	}
+	Node& node = iter->second;
+	if (errcode == kZKSucceed || errcode == kZKStale) {
+		if (node.added && node.stat.czxid != stat.czxid) { // 删除后又被创建，父节点的子节点列表看不出变化
+			RemoveSubtree(path, stat.czxid, false, &operations);
+		}
+		bool changed = node.stat.mzxid != stat.mzxid;
+		node.stat = stat;
+		node.value.assign(value ? value : "", value_len > 0 ? value_len : 0);
+		if (!node.added) {
+			node.added = true;
+			Emit(kZKNodeAdded, path, node, stat.czxid);
+		} else if (changed) {
+			Emit(kZKDataChanged, path, node, stat.mzxid);
+		}
+		if (!node.children_watched) {
+			node.children_watched = true;
+			operations.push_back(std::make_pair(kWatchChildren, path));
+		}
+	} else if (errcode == kZKDeleted || errcode == kZKNotExist) {
+		// 节点删除由父节点的子节点列表发现（那里有pzxid），根节点没有被watch的父节点，在这里处理
+		node.node_watched = false;
+		if (path == path_ && !waiting_root_) {
+			RemoveSubtree(path, 0, false, &operations);
+			waiting_root_ = true;
+			operations.push_back(std::make_pair(kWatchExist, path));
+		}
+	} else { // watch失效，重新订阅
+		operations.push_back(std::make_pair(kWatchNode, path));
+	}
+	pthread_mutex_unlock(&mutex_);
+	Execute(operations);
+}
+
+void ZKSubtreeWatcher::OnChildren(ZKErrorCode errcode, const std::string& path, int count, char** data) {
+	struct Stat stat;
+	memset(&stat, 0, sizeof(stat));
+	if (errcode == kZKSucceed || errcode == kZKStale) {
+		ZKClient::GetInstance().GetCachedChildren(path, NULL, &stat);
+	}
+
+	Operations operations;
+	pthread_mutex_lock(&mutex_);
+	std::map<std::string, Node>::iterator iter = nodes_.find(path);
+	if (stopped_ || iter == nodes_.end()) {
+		pthread_mutex_unlock(&mutex_);
+		return;
+	}
+	Node& node = iter->second;
+	if (errcode == kZKSucceed || errcode == kZKStale) {
+		std::set<std::string> children(data, data + count);
+		for (std::set<std::string>::iterator name = node.children.begin(); name != node.children.end(); ++name) {
+			if (!children.count(*name)) {
+				RemoveSubtree(ChildPath(path, *name), stat.pzxid, true, &operations);
+			}
+		}
+		for (std::set<std::string>::iterator name = children.begin(); name != children.end(); ++name) {
+			// 新出现的子节点，或者删除后又被创建、watch已经失效的子节点
+			Node& child = nodes_[ChildPath(path, *name)];
+			if (!child.node_watched) {
+				child.node_watched = true;
+				operations.push_back(std::make_pair(kWatchNode, ChildPath(path, *name)));
+			}
+		}
+		node.children.swap(children);
+	} else if (errcode == kZKDeleted || errcode == kZKNotExist) {
+		node.children_watched = false;
+	} else {
+		operations.push_back(std::make_pair(kWatchChildren, path));
+	}
+	pthread_mutex_unlock(&mutex_);
+	Execute(operations);
+}
+
+void ZKSubtreeWatcher::OnExist(ZKErrorCode errcode) {
+	Operations operations;
+	pthread_mutex_lock(&mutex_);
+	if (stopped_ || !waiting_root_) {
+		pthread_mutex_unlock(&mutex_);
+		return;
+	}
+	if (errcode == kZKSucceed || errcode == kZKStale) { // 根节点被创建
+		waiting_root_ = false;
+		nodes_[path_].node_watched = true;
+		operations.push_back(std::make_pair(kUnwatchExist, path_));
+		operations.push_back(std::make_pair(kWatchNode, path_));
+	} else if (errcode != kZKNotExist) { // 不存在时watch继续生效，其他情况watch失效，重新订阅
+		operations.push_back(std::make_pair(kWatchExist, path_));
+	}
+	pthread_mutex_unlock(&mutex_);
+	Execute(operations);
+}
+
+std::string ZKSubtreeWatcher::ChildPath(const std::string& path, const std::string& name) const {
+	return path == "/" ? path + name : path + "/" + name;
+}
+
+void ZKSubtreeWatcher::RemoveSubtree(const std::string& path, int64_t zxid, bool erase_self, Operations* operations) {
+	// 后代的路径都以"path/"为前缀，在有序的nodes_里是连续的一段
+	std::string prefix = path == "/" ? path : path + "/";
+	std::map<std::string, Node>::iterator begin = path == "/" ? nodes_.upper_bound(path) : nodes_.lower_bound(prefix);
+	std::map<std::string, Node>::iterator end = begin;
+	while (end != nodes_.end() && end->first.compare(0, prefix.size(), prefix) == 0) {
+		++end;
+	}
+	// 逆序遍历，后代先于祖先
+	for (std::map<std::string, Node>::iterator iter = end; iter != begin; ) {
+		--iter;
+		if (iter->second.added) {
+			Emit(kZKNodeRemoved, iter->first, iter->second, zxid);
+		}
+		operations->push_back(std::make_pair(kUnwatchNode, iter->first));
+		operations->push_back(std::make_pair(kUnwatchChildren, iter->first));
+	}
+	nodes_.erase(begin, end);
+
+	std::map<std::string, Node>::iterator iter = nodes_.find(path);
+	if (iter == nodes_.end()) {
+		return;
+	}
+	Node& node = iter->second;
+	if (node.added) {
+		Emit(kZKNodeRemoved, path, node, zxid);
+	}
+	if (erase_self) {
+		operations->push_back(std::make_pair(kUnwatchNode, path));
+		operations->push_back(std::make_pair(kUnwatchChildren, path));
+		nodes_.erase(iter);
+	} else {
+		node.added = false;
+		node.value.clear();
+		node.children.clear();
+		if (node.children_watched) {
+			node.children_watched = false;
+			operations->push_back(std::make_pair(kUnwatchChildren, path));
+		}
+	}
+}
+
+void ZKSubtreeWatcher::Emit(ZKChangeType type, const std::string& path, const Node& node, int64_t zxid) {
+	if (overflowed_) { // 等待Resync，之后的变化都包含在Resync的结果里
+		return;
+	}
+	if (events_.size() >= capacity_) {
+		Overflow();
+		return;
+	}
+	ZKChangeEvent event;
+	event.type = type;
+	event.path = path;
+	if (type != kZKNodeRemoved) {
+		event.value = node.value;
+	}
+	event.stat = node.stat;
+	event.zxid = zxid;
+	events_.push_back(event);
+	pthread_cond_signal(&cond_);
+}
+
+void ZKSubtreeWatcher::Overflow() {
+	events_.clear();
+	overflowed_ = true;
+	ZKChangeEvent event;
+	event.type = kZKChangeOverflow;
+	event.path = path_;
+	memset(&event.stat, 0, sizeof(event.stat));
+	event.zxid = 0;
+	events_.push_back(event);
+	pthread_cond_broadcast(&cond_);
+}
+
+void ZKSubtreeWatcher::Execute(const Operations& operations) {
+	ZKClient& zkclient = ZKClient::GetInstance();
+	bool failed = false;
+	for (Operations::const_iterator iter = operations.begin(); iter != operations.end(); ++iter) {
+		const std::string& path = iter->second;
+		switch (iter->first) {
+		case kWatchNode:
+			failed = !zkclient.GetNode(path, NodeHandler, this, true) || failed;
+			break;
+		case kWatchChildren:
+			failed = !zkclient.GetChildren(path, ChildrenHandler, this, true) || failed;
+			break;
+		case kWatchExist:
+			failed = !zkclient.Exist(path, ExistHandler, this, true) || failed;
+			break;
+		case kUnwatchNode:
+			zkclient.Unwatch(path, NodeHandler, this);
+			break;
+		case kUnwatchChildren:
+			zkclient.Unwatch(path, ChildrenHandler, this);
+			break;
+		case kUnwatchExist:
+			zkclient.Unwatch(path, ExistHandler, this);
+			break;
+		}
+	}
+	if (failed) { // 订阅请求发不出去（例如ZKClient正在关闭），事件流不再完整
+		pthread_mutex_lock(&mutex_);
+		if (!stopped_ && !overflowed_) {
+			Overflow();
+		}
+		pthread_mutex_unlock(&mutex_);
+	}
+}
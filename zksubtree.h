@@ -0,0 +1,134 @@
+/*
+ * zksubtree.h
+ *
+ *  Created on: 2026年10月19日
+ *      Author: Administrator
+ */
+
+#ifndef ZK_ZKSUBTREE_H_
+#define ZK_ZKSUBTREE_H_
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <deque>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "zkclient.h"
+
+enum ZKChangeType {
+	kZKNodeAdded = 0, // 节点新增（包括Start后发现的已有节点）
+	kZKNodeRemoved, // 节点删除
+	kZKDataChanged, // 节点数据变化
+	kZKChangeOverflow // 队列溢出，之前未取走的事件和之后的变化都被丢弃，需要调用Resync
+};
+
+// 子树的一个变化事件
+struct ZKChangeEvent {
+	ZKChangeType type;
+	std::string path;
+	std::string value; // 新增/数据变化时为最新数据
+	struct Stat stat; // 新增/数据变化时为最新Stat，删除时为最后一次看到的Stat
+	int64_t zxid; // 新增为czxid，数据变化为mzxid，删除为发现删除时父节点的pzxid（根节点被删除时为0）
+};
+
+/**
+ *		监视一整棵子树，把变化变成有序的事件流，下游可以按事件增量更新索引，不需要每次重新扫描。
+ *
+ *		子树的每个节点各订阅一个GetNode和一个GetChildren的watch：子节点列表变化时与上一次的列表比较，
+ *		新出现的子节点自动订阅（递归发现整棵子树），消失的子节点连同其后代一起产生删除事件并取消订阅；
+ *		数据变化由节点自己的watch产生事件，Stat取自ZKClient的watch缓存，版本没变的通知不会产生事件。
+ *		根节点不存在或被删除时用exist watch等待它被创建。订阅失效（例如连接断开时拉取失败）时自动重新订阅，
+ *		重新拉取到的数据与之前的比较后只产生有变化的事件。
+ *
+ *		事件按zk回调的顺序进入有界队列：父节点的新增先于子节点，删除时后代先于祖先。
+ *		队列满时丢弃所有未取走的事件，只留一个kZKChangeOverflow，之后的事件也被丢弃，直到调用Resync：
+ *		Resync原子地返回当前整棵子树（每个节点一个kZKNodeAdded）并清空队列，之后的Poll从这个状态继续。
+ *		订阅请求发不出去（例如ZKClient正在关闭）时同样产生kZKChangeOverflow，表示事件流不再完整。
+ *
+ *		线程安全。对象作为watch回调的context，析构前需确保zk回调不会再并发进入。
+ */
+class ZKSubtreeWatcher {
+public:
+	// capacity为队列最多缓存的事件数
+	explicit ZKSubtreeWatcher(const std::string& path, int capacity = 10000);
+
+	~ZKSubtreeWatcher();
+
+	// 开始监视，已有节点以kZKNodeAdded事件给出。需在ZKClient::Init之后调用，只能调用一次
+	bool Start();
+
+	// 停止监视并取消所有watch，已在队列中的事件仍可取走
+	void Stop();
+
+	/*
+	 * 取出至多max_events个事件，追加到events，返回取到的个数。
+	 * 队列为空时最多等待timeout_ms，为0时不等待。
+	 */
+	int Poll(std::vector<ZKChangeEvent>* events, int max_events, int timeout_ms);
+
+	// 以kZKNodeAdded事件返回当前整棵子树（按路径排序，父节点在前），并清空队列和溢出状态，返回节点数
+	int Resync(std::vector<ZKChangeEvent>* events);
+
+private:
+	struct Node {
+		Node() : added(false), node_watched(false), children_watched(false) {
+			memset(&stat, 0, sizeof(stat));
+		}
+
+		bool added; // 已拿到数据并产生过kZKNodeAdded
+		bool node_watched; // GetNode的watch生效中
+		bool children_watched; // GetChildren的watch生效中
+		struct Stat stat;
+		std::string value;
+		std::set<std::string> children;
+	};
+
+	enum OperationType {
+		kWatchNode = 0,
+		kWatchChildren,
+		kWatchExist,
+		kUnwatchNode,
+		kUnwatchChildren,
+		kUnwatchExist
+	};
+
+	// 回调里不能持有mutex_调用ZKClient，先记下要做的订阅操作，解锁后执行
+	typedef std::vector<std::pair<OperationType, std::string> > Operations;
+
+	static void NodeHandler(ZKErrorCode errcode, const std::string& path, const char* value, int value_len,
+			void* context);
+	static void ChildrenHandler(ZKErrorCode errcode, const std::string& path, int count, char** data, void* context);
+	static void ExistHandler(ZKErrorCode errcode, const std::string& path, const struct Stat* stat, void* context);
+
+	void OnNode(ZKErrorCode errcode, const std::string& path, const char* value, int value_len);
+	void OnChildren(ZKErrorCode errcode, const std::string& path, int count, char** data);
+	void OnExist(ZKErrorCode errcode);
+
+	std::string ChildPath(const std::string& path, const std::string& name) const;
+	// 删除path的所有后代并产生删除事件，erase_self为false时path本身只重置为未新增的状态
+	void RemoveSubtree(const std::string& path, int64_t zxid, bool erase_self, Operations* operations);
+	void Emit(ZKChangeType type, const std::string& path, const Node& node, int64_t zxid);
+	void Overflow();
+	void Execute(const Operations& operations);
+
+	ZKSubtreeWatcher(const ZKSubtreeWatcher&);
+	ZKSubtreeWatcher& operator=(const ZKSubtreeWatcher&);
+
+	std::string path_;
+	size_t capacity_;
+
+	// 以下字段由mutex_保护
+	bool started_;
+	bool stopped_;
+	bool overflowed_;
+	bool waiting_root_; // 根节点不存在，exist watch生效中
+	std::map<std::string, Node> nodes_; // 路径 -> 节点，路径有序时父节点排在其后代之前
+	std::deque<ZKChangeEvent> events_;
+	pthread_mutex_t mutex_;
+	pthread_cond_t cond_;
+};
+
+#endif /* ZK_ZKSUBTREE_H_ */